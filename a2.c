@@ -20,29 +20,824 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <signal.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <fnmatch.h>
+#include <pwd.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <linux/kcmp.h>
+#include "fdtables.h"
 
 #define MAX_PATH_LEN 256
 #define MAX_FILENAME_LEN 256
 #define MAX_LINE_LEN 256
+#define DENTS_BUF_LEN 65536
+#define LINK_BUF_LEN 4096
+#define ARENA_MIN_BLOCK 1024
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define STAT_RING_ENTRIES 256
+#define FDINFO_BUF_LEN 4096
+#define OUT_BUF_LEN (256 * 1024)
+#define OUT_QUEUE_LEN 4
+#define OUT_TEXT 0
+#define OUT_NDJSON 1
+#define OUT_CSV 2
+#define OUT_TSV 3
+#define TABLE_RULE "========================================\n"
+#define LATENCY_BUCKETS 16
+#define STATS_SLOWEST 5
+#define LEAK_MAX_SAMPLES 64
+#define WATCH_RECHECK_TICKS 10
+#define DAEMON_REQUEST_SECONDS 2
+#define MAX_SINKS 8
+#define SINK_TABLE 0
+#define SINK_BINARY 1
+#define LEAK_MIN_GROWTH 2
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+// Raw record layout returned by getdents64(2)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Syscalls issued by the collector, counted for --stats
+enum {
+    SC_OPENAT,
+    SC_GETDENTS,
+    SC_READLINKAT,
+    SC_FSTATAT,
+    SC_CLOSE,
+    SC_READ,
+    SC_STATX,                       // statx requests completed through io_uring
+    SC_URING_ENTER,
+    SC_KCMP,
+    SC_KINDS
+};
+
+// Why a counted syscall failed: EACCES/EPERM, ENOENT/ESRCH (the process
+// exited under us), anything else
+enum {
+    SF_DENIED,
+    SF_GONE,
+    SF_OTHER,
+    SF_KINDS
+};
+
+// Phases of a run, each timed in wall and CPU seconds
+enum {
+    PH_LIST,
+    PH_WALK,
+    PH_SOCKETS,
+    PH_OUTPUT,
+    PH_SAVE,
+    PH_KINDS
+};
+
+// Start of a timed phase
+typedef struct {
+    double wall;
+    double cpu;
+} phase_mark;
+
+// A process whose fd directory took long to walk
+typedef struct {
+    pid_t pid;
+    unsigned long fds;
+    double seconds;
+} slow_pid;
+
+// A descriptor whose stat + readlink took long
+typedef struct {
+    pid_t pid;
+    int fd;
+    double seconds;
+    char target[MAX_FILENAME_LEN];
+} slow_target;
+
+// What only --stats records. Kept out of scan_stats, which every snapshot
+// carries, and allocated by the first note_* call.
+typedef struct {
+    // Per-call latency, bucket b counting calls under 2^b microseconds
+    // (the last bucket takes everything slower). Only filled for the
+    // per-descriptor fstatat/readlinkat calls.
+    unsigned long latency[SC_KINDS][LATENCY_BUCKETS];
+    slow_pid slow_pids[STATS_SLOWEST];      // slowest first
+    size_t nslow_pids;
+    slow_target slow_targets[STATS_SLOWEST];
+    size_t nslow_targets;
+} scan_timing;
+
+typedef struct {
+    unsigned long calls[SC_KINDS];
+    unsigned long failures[SC_KINDS][SF_KINDS];
+    unsigned long processes;        // fd directories successfully walked
+    unsigned long descriptors;
+    unsigned long filtered_pids;    // dropped before their fd dir was opened
+    unsigned long filtered_fds;     // dropped before being stat-ed
+    unsigned long shared_pids;      // fd table copied from a PID sharing it
+    double scan_seconds;            // wall time of the whole collection
+    double phase_wall[PH_KINDS];
+    double phase_cpu[PH_KINDS];     // summed over all threads of the process
+    scan_timing *timing;            // NULL until something was timed
+} scan_stats;
+
+// One open file descriptor as seen during the single /proc scan
+typedef struct {
+    pid_t pid;
+    int fd;
+    int has_target;                 // readlink() on the fd succeeded
+    int has_inode;                  // stat() through the fd link succeeded
+    ino_t inode;
+    dev_t dev;
+    mode_t mode;                    // file type bits, sockets and pipes included
+    const char *target;             // interned in the snapshot's arena, "" if unread
+    // From /proc/<pid>/fdinfo/<fd>, read only when --columns asks for them
+    int has_fdinfo;
+    int mnt_id;
+    unsigned int flags;             // O_* flags of the open file description
+    long long pos;
+    const char *extra;              // type-specific fdinfo lines, "; "-joined and interned
+} fd_record;
+
+// One socket from /proc/net/{tcp,tcp6,udp,udp6,unix}
+enum {
+    SOCK_PROTO_TCP,
+    SOCK_PROTO_TCP6,
+    SOCK_PROTO_UDP,
+    SOCK_PROTO_UDP6,
+    SOCK_PROTO_UNIX
+};
+
+typedef struct {
+    uint64_t inode;                 // 0 marks an empty hash slot
+    uint8_t proto;
+    uint8_t state;                  // TCP state, or unix SS_* state
+    uint8_t type;                   // unix socket type
+    uint16_t local_port;
+    uint16_t remote_port;
+    uint8_t local_addr[16];         // network byte order
+    uint8_t remote_addr[16];
+    uint32_t path;                  // unix: offset into paths, or UINT32_MAX
+} socket_info;
+
+// Open-addressed socket_info table keyed by inode
+typedef struct {
+    socket_info *slots;
+    size_t slot_count;
+    size_t used;
+    char *paths;
+    size_t paths_size;
+    size_t paths_capacity;
+} socket_table;
+
+// Number of descriptors a process had open at scan time
+typedef struct {
+    pid_t pid;
+    unsigned long fds;
+} proc_count;
+
+// Chunk of a string_arena; strings are bump-allocated out of data
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block;
+
+// Owns the link targets of one snapshot. Each distinct target is stored once
+// (/dev/null, ptys, shared libraries and logs repeat a lot), and blocks never
+// move, so records simply point into them.
+typedef struct {
+    arena_block *blocks;            // newest first
+    const char **slots;             // open-addressed intern table, NULL = empty
+    size_t slot_count;
+    size_t used;
+} string_arena;
+
+// A growable list of PIDs
+typedef struct {
+    pid_t *pids;
+    size_t count;
+    size_t capacity;
+} pid_array;
+
+// Point-in-time view of every descriptor, shared by all table views
+typedef struct {
+    fd_record *records;
+    size_t count;
+    size_t capacity;
+    proc_count *procs;              // one entry per scanned process
+    size_t nprocs;
+    size_t procs_capacity;
+    socket_table *sockets;          // /proc/net join, when --sockets was given
+    time_t scanned;                 // when collect_snapshot started
+    string_arena strings;           // every record's target
+    scan_stats stats;
+    // --budget only: processes walked whole, those the deadline caught
+    // halfway through their fd table (the rows read so far are kept), and
+    // those it cut off, in the order they were visited
+    pid_array covered;
+    pid_array partial;
+    pid_array skipped;
+    int pid_error;                  // errno of a single-PID scan that failed, else 0
+} fd_snapshot;
+
+// What the collector should gather and how
+typedef struct {
+    const char *proc_root;          // "/proc", or a synthetic tree
+    pid_t pid;                      // -1 scans every process
+    int need_inode;                 // some view prints inodes
+    int count_only;                 // only per-process fd counts are needed
+    int sockets;                    // load /proc/net socket tables with the scan
+    int size_counts;                // count from /proc/<pid>/fd st_size (set by the collector)
+    int match_inode;                // keep only descriptors of (match_dev, match_ino)
+    dev_t match_dev;
+    ino_t match_ino;
+    int jobs;                       // worker threads for the full scan
+    int timed;                      // record latencies and slow PIDs/targets
+    // Filters, applied as early as the scan allows (see pid_selected and
+    // resolve_target)
+    const pid_t *pid_list;          // sorted; NULL keeps every PID
+    size_t npid_list;
+    int by_uid;
+    uid_t uid;
+    const char *comm_glob;
+    int fd_types;                   // FD_TYPE_* bits; 0 keeps every type
+    const char *path_prefix;
+    // Serial scans only: called after each process is scanned, after which
+    // its records are dropped, so the snapshot never holds more than one
+    // process. The caller then gets an empty snapshot back.
+    void (*emit)(const fd_snapshot *snap, void *arg);
+    void *emit_arg;
+    int use_ring;                   // batch fd stats through io_uring when available
+    int fdinfo;                     // read fdinfo for the descriptors that are kept
+    double budget;                  // --budget in seconds, 0 for none
+    double deadline;                // now_seconds() at which to stop (set by the collector)
+    const pid_t *pid_order;         // --pid-list as given: the visiting order under a budget
+} scan_options;
+
+// One scanning thread's io_uring, used to stat a whole getdents64 batch of
+// fd links at once instead of one blocking fstatat after another. The
+// kernel runs the statx requests concurrently, so one slow mount no longer
+// serializes the rest of the batch.
+typedef struct {
+    int fd;
+    int broken;                     // IORING_OP_STATX unsupported: stat synchronously
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    char names[STAT_RING_ENTRIES][16];
+    struct statx bufs[STAT_RING_ENTRIES];
+} stat_ring;
+
+// Descriptor kinds for --fd-type, told apart by link target
+#define FD_TYPE_FILE 1
+#define FD_TYPE_SOCKET 2
+#define FD_TYPE_PIPE 4
+#define FD_TYPE_ANON 8
+
+// Composite table columns, in --columns order. Everything from COL_POS on
+// costs a read of /proc/<pid>/fdinfo/<fd>.
+enum {
+    COL_PID,
+    COL_FD,
+    COL_FILENAME,
+    COL_INODE,
+    COL_POS,
+    COL_FLAGS,
+    COL_MNT_ID,
+    COL_EXTRA,
+    COL_KINDS
+};
+
+// A contiguous range [head, tail) of the shared PID list owned by one worker.
+// The owner pops from the head, thieves split off the back half.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} scan_queue;
+
+// Where one PID's results landed in its worker's snapshot; SIZE_MAX marks
+// an index with nothing there
+typedef struct {
+    int worker;
+    size_t first;                   // records [first, first + count)
+    size_t count;
+    size_t proc;                    // in procs
+    size_t covered;                 // in covered
+    size_t partial;                 // in partial
+    size_t skipped;                 // in skipped
+} scan_slot;
+
+// State shared by the worker pool of a parallel scan
+typedef struct {
+    const scan_options *opts;
+    int proc_fd;
+    const pid_t *pids;
+    fd_snapshot *partials;          // one snapshot per worker
+    scan_slot *slots;               // one per PID, merged in list order
+    scan_queue *queues;
+    int jobs;
+} scan_pool;
+
+// An fd table already scanned, and where its records are
+typedef struct {
+    pid_t pid;
+    const fd_snapshot *snap;
+    size_t first;
+    size_t count;
+    unsigned long fds;
+} shared_table;
+
+// The fd tables one scanning thread has walked, kept in kcmp(KCMP_FILES)
+// order. Processes created with CLONE_FILES compare equal there, so each
+// new PID costs O(log n) kcmp calls to find a table it can copy instead
+// of reading its links again.
+typedef struct {
+    shared_table *tables;
+    size_t count;
+    size_t capacity;
+    int disabled;                   // nothing to gain, or no kcmp in this kernel
+} table_index;
+
+typedef struct {
+    scan_pool *pool;
+    int id;
+    int error;                      // errno of a failure that stopped this worker, else 0
+} scan_worker;
+
+// --summary group keys. PID and UID groups come from per-process fd
+// counts alone; the others need each descriptor's link (and mount, its
+// stat).
+enum {
+    SUM_PID,
+    SUM_UID,
+    SUM_MOUNT,
+    SUM_TYPE,
+    SUM_TARGET,
+    SUM_KINDS
+};
+
+// Key fields of a group are joined with SUMMARY_SEP into one interned string
+#define SUMMARY_SEP '\x1f'
+
+typedef struct {
+    const char *key;                // NULL marks an empty slot
+    unsigned long fds;
+    unsigned long procs;            // distinct PIDs counted into the group
+    pid_t last_pid;
+} summary_group;
+
+// Running --summary aggregation. Fed one process at a time while the scan
+// streams, so memory grows with the number of groups, never with rows.
+typedef struct {
+    int keys[SUM_KINDS];
+    int nkeys;
+    int per_fd;                     // some key needs descriptor records
+    int need_inode;                 // some key needs them stat'ed (mount)
+    int proc_fd;                    // for UID lookups
+    pid_t uid_pid;                  // last UID lookup
+    uid_t uid;
+    int uid_known;
+    unsigned long uid_lookups;
+    summary_group *slots;
+    size_t slot_count;
+    size_t used;
+    string_arena strings;
+    char *key;                      // the group key being built, grown as needed
+    size_t key_capacity;
+} summary_state;
+
+// On-disk layout of --output_binary snapshots (version 1, host byte order).
+// The file is a header followed by three sections, each 8-byte aligned so a
+// reader can mmap it and use the arrays in place:
+//   records  record_count x snapshot_file_record, grouped by PID
+//   index    index_count x snapshot_file_index, sorted by PID
+//   strings  NUL-terminated targets, each distinct target stored once
+#define SNAPSHOT_MAGIC "FDSNAP\0\0"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NO_TARGET UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int64_t created;                // unix time of the scan
+    uint64_t record_count;
+    uint64_t records_offset;
+    uint64_t index_count;
+    uint64_t index_offset;
+    uint64_t strings_size;
+    uint64_t strings_offset;
+} snapshot_file_header;
+
+typedef struct {
+    int32_t pid;
+    int32_t fd;
+    uint32_t target;                // offset into strings, or SNAPSHOT_NO_TARGET
+    uint32_t mode;                  // 0 when the fd could not be stat-ed
+    uint64_t inode;
+    uint64_t dev;
+} snapshot_file_record;
+
+typedef struct {
+    int32_t pid;
+    uint32_t count;
+    uint64_t first;                 // index of the PID's first record
+} snapshot_file_index;
+
+// History log written by --record: an append-only file of frames after a
+// history_file_header. A keyframe holds the whole table as one snapshot
+// blob (the format above); a delta holds two, the rows closed and then the
+// rows opened since the previous frame. Blobs are padded to 8 bytes so a
+// reader can use them in place from a mapping. FILE.idx lists the time and
+// offset of every keyframe, so a reader seeks straight to the keyframe
+// before the time it wants; without it the frame headers are walked.
+#define HISTORY_MAGIC "FDHIST\0\0"
+#define HISTORY_INDEX_MAGIC "FDHIDX\0\0"
+#define HISTORY_VERSION 1
+#define HISTORY_KEYFRAME 1
+#define HISTORY_DELTA 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} history_file_header;
+
+typedef struct {
+    uint32_t kind;                  // HISTORY_KEYFRAME or HISTORY_DELTA
+    uint32_t reserved;
+    int64_t time_ms;                // unix time of the scan, in milliseconds
+    uint64_t size;                  // payload bytes after this header
+    uint64_t first_size;            // padded size of the first blob
+} history_frame_header;
+
+typedef struct {
+    int64_t time_ms;
+    uint64_t offset;                // of the keyframe's history_frame_header
+} history_index_entry;
+
+// Builds the deduplicated string section while the records are written
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    uint32_t *slots;                // open-addressed offsets, UINT32_MAX = empty
+    size_t slot_count;
+    size_t used;
+} string_table;
+
+// Per-process state kept between --watch ticks
+typedef struct {
+    pid_t pid;
+    off_t fd_count;                 // st_size of /proc/<pid>/fd at the last scan
+    struct timespec mtime;
+    fd_snapshot fds;                // this process's records, sorted by fd
+} watch_entry;
+
+// Per-process history kept by --leaks: the fd counts of the last samples,
+// in a ring whose next slot is head. Only totals are kept; the split by
+// descriptor type comes from one scan when the process is flagged.
+typedef struct {
+    pid_t pid;
+    unsigned long long start;       // start time from /proc/<pid>/stat, 0 if unread
+    unsigned int head;
+    unsigned int filled;
+    int flagged;
+    uint32_t counts[LEAK_MAX_SAMPLES];
+} leak_entry;
+
+// A file the composite table is written to alongside the screen output.
+// Every sink gets its own thread and writer, all reading the one snapshot.
+typedef struct {
+    int kind;                       // SINK_TABLE or SINK_BINARY
+    int format;                     // OUT_* of a SINK_TABLE
+    const char *path;
+    const fd_snapshot *snap;
+    pid_t pid;
+    pthread_t thread;
+} file_sink;
+
+// Buffered table output written with writev(2) in large chunks. Rows are
+// formatted into a ring of OUT_QUEUE_LEN buffers; full buffers go to a
+// writer thread (or straight to the fd when the stream is not threaded).
+typedef struct {
+    int fd;
+    int threaded;
+    int format;                     // OUT_*: how composite rows are written
+    const int *columns;             // COL_* from --columns; NULL keeps the fixed four
+    int ncolumns;
+    char *bufs[OUT_QUEUE_LEN];
+    size_t lens[OUT_QUEUE_LEN];
+    int fill;                       // buffer being formatted into
+    size_t len;                     // bytes used in bufs[fill]
+    int head;                       // first buffer queued for the writer
+    int queued;                     // buffers owned by the writer
+    int closing;
+    int error;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;           // writer: buffers queued or closing
+    pthread_cond_t drained;         // formatter: the writer released buffers
+} out_stream;
+
+// A parsed --open-by argument
+typedef struct {
+    const char *text;
+    int by_inode;                   // else match link targets against text
+    int by_path;                    // text is a path: match "text (deleted)" too
+    dev_t dev;
+    ino_t ino;
+} open_by_query;
+
+// Reverse index over a snapshot: (dev, inode) -> records and
+// target string -> records, as chained hash tables
+#define FD_INDEX_END ((size_t)-1)
+#define FD_INDEX_START ((size_t)-2)
+
+typedef struct {
+    size_t slot_count;
+    size_t *inode_heads;
+    size_t *target_heads;
+    size_t *next_inode;
+    size_t *next_target;
+} fd_index;
+
+// An encoded daemon reply. The whole-snapshot blob is shared by every
+// client sending it and freed by whoever drops the last reference.
+typedef struct {
+    unsigned int refs;
+    size_t size;
+    char *data;
+} daemon_blob;
+
+// A --daemon server: the live snapshot, its index and its encoding,
+// replaced wholesale by the refresh thread under the write lock
+typedef struct {
+    scan_options opts;
+    double interval;
+    pthread_rwlock_t lock;
+    fd_snapshot snap;
+    fd_index idx;
+    daemon_blob *composite;
+} daemon_state;
+
+// One accepted connection, handed to its own thread
+typedef struct {
+    daemon_state *state;
+    int client;
+} daemon_client;
 
 // Function prototypes
-void display_process_fd_table(pid_t pid);
-void display_systemwide_fd_table(pid_t pid);
-void display_vnodes_fd_table(pid_t pid);
-void display_composed_table(pid_t pid);
-void flag_offending_processes(int threshold);
+int collect_snapshot(fd_snapshot *snap, const scan_options *opts);
+void collect_or_exit(fd_snapshot *snap, const scan_options *opts);
+void emit_and_drop(fd_snapshot *snap, const scan_options *opts);
+void deliver_records(const fd_snapshot *snap, void *arg);
+int collect_pid(fd_snapshot *snap, int proc_fd, pid_t pid, const scan_options *opts, stat_ring *ring,
+                int selected);
+int collect_pid_shared(fd_snapshot *snap, int proc_fd, pid_t pid, const scan_options *opts, stat_ring *ring,
+                       table_index *index);
+int find_shared_table(table_index *index, pid_t pid, size_t *slot, scan_stats *stats);
+int copy_shared_table(fd_snapshot *snap, const shared_table *table, pid_t pid);
+stat_ring *stat_ring_open(void);
+void stat_ring_close(stat_ring *ring);
+void resolve_pending(fd_snapshot *snap, stat_ring *ring, int fd_dirfd, const size_t *pending, size_t n,
+                     int *errs, const scan_options *opts);
+int pid_selected(int proc_fd, pid_t pid, const scan_options *opts, scan_stats *stats);
+int fd_type_of(const char *target);
+int target_selected(const char *target, const scan_options *opts);
+int parse_fd_types(const char *list);
+uid_t parse_uid(const char *arg);
+int parse_columns(const char *list, int *columns);
+int resolve_fdinfo(fd_snapshot *snap, int proc_fd, pid_t pid, size_t first);
+int parse_fdinfo(fd_snapshot *snap, fd_record *rec, const char *info);
+size_t parse_pid_list(const char *list, pid_t **pids, pid_t **order);
+void order_by_fd_count(int proc_fd, pid_t *pids, size_t npids, scan_stats *stats);
+void interleave_pids(pid_t *pids, size_t npids, int jobs);
+int compare_proc_heavier(const void *a, const void *b);
+int pid_array_push(pid_array *array, pid_t pid);
+void display_budget_report(out_stream *out, const fd_snapshot *snap, double budget);
+int resolve_inode(fd_snapshot *snap, int fd_dirfd, const char *name, fd_record *rec, const scan_options *opts);
+int resolve_target(fd_snapshot *snap, int fd_dirfd, const char *name, fd_record *rec, char **link,
+                   size_t *link_size, const scan_options *opts, double fd_started);
+fd_record *append_record(fd_snapshot *snap);
+fd_record *append_record_or_exit(fd_snapshot *snap);
+int append_proc_count(fd_snapshot *snap, pid_t pid, unsigned long fds);
+int kernel_reports_fd_counts(int proc_fd);
+ssize_t list_pids(int proc_fd, pid_t **pids, scan_stats *stats);
+int collect_parallel(fd_snapshot *snap, int proc_fd, const pid_t *pids, size_t npids, const scan_options *opts);
+void merge_stats(scan_stats *into, const scan_stats *from);
+double now_seconds(void);
+double cpu_seconds(void);
+void phase_start(phase_mark *mark);
+void phase_stop(scan_stats *stats, int phase, const phase_mark *mark);
+void note_failure(scan_stats *stats, int call);
+void note_latency(scan_stats *stats, int call, double seconds);
+scan_timing *stats_timing(scan_stats *stats);
+void note_slow_pid(scan_stats *stats, pid_t pid, unsigned long fds, double seconds);
+void note_slow_target(scan_stats *stats, pid_t pid, int fd, const char *target, double seconds);
+void print_scan_stats(const scan_stats *stats, int format);
+void print_scan_stats_json(const scan_stats *stats);
+void print_json_string(FILE *file, const char *str);
+void *scan_worker_main(void *arg);
+int merge_partials(fd_snapshot *snap, const scan_pool *pool, size_t npids);
+int steal_work(scan_pool *pool, int thief);
+void free_snapshot(fd_snapshot *snap);
+void reset_snapshot(fd_snapshot *snap);
+const char *arena_intern(string_arena *arena, const char *str);
+char *arena_alloc(string_arena *arena, size_t len);
+void arena_reset(string_arena *arena);
+void arena_free(string_arena *arena);
+ssize_t read_link(int dirfd, const char *name, char **buf, size_t *size, scan_stats *stats);
+void out_open(out_stream *out, int fd, int threaded);
+int out_close(out_stream *out);
+void out_flush(out_stream *out);
+void out_submit(out_stream *out);
+void *out_writer_main(void *arg);
+int write_all(int fd, struct iovec *iov, int count);
+void out_write(out_stream *out, const char *data, size_t len);
+void out_str(out_stream *out, const char *str);
+void out_char(out_stream *out, char c);
+void out_uint(out_stream *out, unsigned long value);
+void out_int(out_stream *out, long value);
+void display_process_fd_table(out_stream *out, const fd_snapshot *snap, pid_t pid);
+void display_systemwide_fd_table(out_stream *out, const fd_snapshot *snap, pid_t pid);
+void display_vnodes_fd_table(out_stream *out, const fd_snapshot *snap, pid_t pid);
+void display_composed_table(out_stream *out, const fd_snapshot *snap, pid_t pid);
+void composite_header(out_stream *out, int with_sockets);
+void composite_footer(out_stream *out);
+void composite_rows(out_stream *out, const fd_snapshot *snap, pid_t pid);
+void emit_composite_rows(const fd_snapshot *snap, void *arg);
+void write_column_row(out_stream *out, const fd_record *rec, const socket_table *sockets);
+void write_record_row(out_stream *out, const fd_record *rec, const socket_table *sockets);
+void out_column_value(out_stream *out, const fd_record *rec, int column, const socket_table *sockets);
+void write_composite_row(out_stream *out, pid_t pid, int fd, const char *target, unsigned long inode,
+                         const socket_table *sockets);
+void out_escaped(out_stream *out, const char *str, int format);
+void flag_offending_processes(out_stream *out, const fd_snapshot *snap, int threshold);
+void display_top_processes(out_stream *out, const fd_snapshot *snap, int k);
+int proc_heavier(const proc_count *a, const proc_count *b);
+void sift_up(proc_count *heap, size_t i);
+void sift_down(proc_count *heap, size_t size, size_t i);
+void parse_open_by(const char *query, open_by_query *q);
+int parse_summary_keys(const char *list, int *keys);
+void summary_init(summary_state *sum, const int *keys, int nkeys, const char *proc_root);
+void summary_free(summary_state *sum);
+void summary_add(const fd_snapshot *snap, void *arg);
+void summary_count(summary_state *sum, pid_t pid, const fd_record *rec, unsigned long fds);
+int summary_uid(summary_state *sum, pid_t pid, uid_t *uid);
+int compare_summary_group(const void *a, const void *b);
+void display_summary(out_stream *out, summary_state *sum, int top);
+void build_fd_index(fd_index *idx, const fd_snapshot *snap);
+void free_fd_index(fd_index *idx);
+size_t fd_index_next_inode(const fd_index *idx, const fd_snapshot *snap, dev_t dev, ino_t ino, size_t i);
+size_t fd_index_next_target(const fd_index *idx, const fd_snapshot *snap, const char *target, size_t i);
+uint64_t hash_inode(dev_t dev, ino_t ino);
+void display_open_by(out_stream *out, const fd_snapshot *snap, const open_by_query *q);
+socket_table *load_socket_table(const char *proc_root, scan_stats *stats);
+void free_socket_table(socket_table *table);
+int split_fields(char *line, char **fields, int max);
+unsigned long parse_hex(const char *s, const char **end);
+void parse_net_address(const char *field, int words, uint8_t *addr, uint16_t *port);
+int parse_socket_line(char *line, int proto, socket_table *table, socket_info *info);
+void socket_table_insert(socket_table *table, const socket_info *info);
+const socket_info *socket_table_find(const socket_table *table, uint64_t inode);
+void out_socket_annotation(out_stream *out, const socket_table *table, const char *target, int format);
+void out_address(out_stream *out, int family, const uint8_t *addr, uint16_t port);
 void display_usage();
 int isPid(char* string);
-void save_composite_table_text(const char *filename, pid_t pid);
-void save_composite_table_binary(const char *filename, pid_t pid);
+void save_composite_table_text(const char *filename, const fd_snapshot *snap, pid_t pid, int format);
+void add_sink(file_sink *sinks, int *nsinks, int kind, int format, const char *path);
+void start_sinks(file_sink *sinks, int nsinks, const fd_snapshot *snap, pid_t pid);
+void finish_sinks(file_sink *sinks, int nsinks);
+void *sink_main(void *arg);
+void save_composite_table_binary(const char *filename, const fd_snapshot *snap, pid_t pid);
+void read_composite_table_binary(out_stream *out, const char *filename, pid_t pid);
+size_t encode_snapshot(const fd_snapshot *snap, pid_t pid, const char *keep, char **blob);
+int snapshot_valid(const char *base, size_t size);
+int blob_array_fits(uint64_t offset, uint64_t count, size_t item_size, size_t size);
+void write_binary_rows(out_stream *out, const char *base, pid_t pid);
+void run_daemon(const char *path, const scan_options *opts, double interval);
+void record_history(const char *path, const scan_options *opts, double interval, int keyframe_every);
+int open_history_file(const char *path, const char *magic);
+size_t mark_deltas(const fd_snapshot *before, const fd_snapshot *after, char *closed, char *opened);
+void write_history_frame(int fd, int index_fd, uint32_t kind, int64_t time_ms, char *first, size_t first_size,
+                         char *second, size_t second_size);
+void replay_history(out_stream *out, const char *path, pid_t pid, double at, double from, double to, int changes);
+const char *map_history_file(const char *path, const char *magic, size_t *size);
+int history_frame_valid(const char *base, size_t size, uint64_t offset);
+void load_blob_rows(fd_snapshot *snap, const char *blob);
+void apply_history_delta(fd_snapshot *state, fd_snapshot *scratch, const char *closed, const char *opened);
+void print_blob_changes(out_stream *out, int64_t time_ms, char op, const char *blob, pid_t pid);
+int compare_record_key(const void *a, const void *b);
+void *daemon_refresh_main(void *arg);
+void *daemon_client_main(void *arg);
+void serve_client(daemon_state *state, int client);
+int client_time_left(int client, int option, double deadline);
+daemon_blob *answer_query(daemon_state *state, const char *request);
+daemon_blob *daemon_blob_encode(const fd_snapshot *snap, const char *keep);
+void daemon_blob_release(daemon_blob *blob);
+void mark_open_by(const fd_index *idx, const fd_snapshot *snap, const open_by_query *q, char *keep);
+size_t query_daemon(int sock, const char *request, char **blob);
+int read_full(int fd, char *buf, size_t len);
+void display_from_daemon(out_stream *out, const char *path, pid_t pid, int composite, int threshold,
+                         const char *open_by);
+uint32_t intern_string(string_table *table, const char *str);
+uint64_t hash_string(const char *str);
+int compare_file_index(const void *a, const void *b);
+void watch_descriptors(out_stream *out, const scan_options *opts, double interval, int show_stats);
+void print_fd_deltas(out_stream *out, const fd_snapshot *before, const fd_snapshot *after);
+void print_fd_delta(out_stream *out, char op, const fd_record *rec);
+int compare_record_fd(const void *a, const void *b);
+int compare_proc_pid(const void *a, const void *b);
+void track_leaks(out_stream *out, const scan_options *opts, double interval, int samples);
+int leak_trend(const leak_entry *e, int samples, double interval, double *rate, int *steady);
+void leak_push(leak_entry *e, uint32_t fds, int samples);
+void print_leak(out_stream *out, fd_snapshot *detail, const scan_options *opts, const leak_entry *e,
+                int samples, double rate, int steady);
+unsigned long long process_start(int proc_fd, pid_t pid);
+int leak_pid_reused(out_stream *out, int proc_fd, leak_entry *e);
+int compare_pid(const void *a, const void *b);
+
 
+// State behind an fdt_scanner (fdtables.h)
+struct fdt_scanner {
+    char *proc_root;
+    fd_snapshot snap;               // kept across scans for its buffers
+    fdt_callback callback;
+    void *arg;
+    size_t delivered;
+};
 
+// The library build (make lib) leaves out the command line
+#ifndef FDTABLES_LIBRARY
 int main(int argc, char *argv[]) {
     // Parse command-line arguments
-    int per_process = 0, system_wide = 0, vnodes = 0, composite = 0, save_text = 0, save_binary = 0;
+    int per_process = 0, system_wide = 0, vnodes = 0, composite = 0;
+    file_sink sinks[MAX_SINKS];
+    int nsinks = 0;
     int threshold = -1;
+    int top = 0;
+    int jobs = 1;
+    int show_stats = 0;
+    int sockets = 0;
+    int uring = 0;
+    const char *read_binary = NULL;
+    const char *open_by = NULL;
+    const char *proc_root = "/proc";
+    const char *daemon_path = NULL;
+    const char *query_path = NULL;
+    double refresh_interval = 5;
+    const char *comm_glob = NULL;
+    const char *path_prefix = NULL;
+    const char *uid_arg = NULL;
+    pid_t *pid_list = NULL;
+    pid_t *pid_order = NULL;
+    size_t npid_list = 0;
+    double budget = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    int keyframe_every = 60;
+    double replay_at = -1, replay_from = -1, replay_to = -1;
+    int fd_types = 0;
+    int format = OUT_TEXT;
+    int columns[COL_KINDS];
+    int ncolumns = 0;
+    int summary_keys[SUM_KINDS];
+    int nsummary_keys = 0;
+    double watch_interval = 0;
+    double leak_interval = 0;
+    int leak_samples = 10;
     pid_t pid = -1;
 
     for (int i = 1; i < argc; i++) {
@@ -64,14 +859,181 @@ int main(int argc, char *argv[]) {
             strncpy(num,argv[i]+12,lenOfNum+1);
             threshold = atoi(num);
         }
+        else if (strncmp(argv[i], "--top=", 6) == 0){
+            top = atoi(argv[i] + 6);
+            if (top < 1){
+                printf("Invalid top count: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--jobs=", 7) == 0){
+            jobs = atoi(argv[i] + 7);
+            if (jobs < 1){
+                printf("Invalid job count: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0){
+            show_stats = STATS_TEXT;
+        }
+        else if (strcmp(argv[i], "--stats=json") == 0){
+            show_stats = STATS_JSON;
+        }
+        else if (strcmp(argv[i], "--sockets") == 0){
+            sockets = 1;
+        }
+        else if (strcmp(argv[i], "--uring") == 0){
+            uring = 1;
+        }
         else if (isPid(argv[i])){
             pid = atoi(argv[i]);
         }
         else if (strcmp(argv[i], "--output_TXT") == 0){
-            save_text = 1;
+            add_sink(sinks, &nsinks, SINK_TABLE, OUT_TEXT, "compositeTable.txt");
         }
         else if(strcmp(argv[i], "--output_binary") == 0){
-            save_binary = 1;
+            add_sink(sinks, &nsinks, SINK_BINARY, OUT_TEXT, "compositeTable.bin");
+        }
+        else if (strncmp(argv[i], "--output=", 9) == 0){
+            const char *name = argv[i] + 9;
+            const char *path = strchr(name, ':');
+            int kind = SINK_TABLE, sink_format = OUT_TEXT;
+            if (path == NULL || path[1] == '\0'){
+                printf("Expected FORMAT:FILE: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+            size_t len = (size_t)(path - name);
+            if (len == 4 && strncmp(name, "text", 4) == 0) sink_format = OUT_TEXT;
+            else if (len == 6 && strncmp(name, "ndjson", 6) == 0) sink_format = OUT_NDJSON;
+            else if (len == 3 && strncmp(name, "csv", 3) == 0) sink_format = OUT_CSV;
+            else if (len == 3 && strncmp(name, "tsv", 3) == 0) sink_format = OUT_TSV;
+            else if (len == 6 && strncmp(name, "binary", 6) == 0) kind = SINK_BINARY;
+            else {
+                printf("Unknown format: %.*s\n", (int)len, name);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+            add_sink(sinks, &nsinks, kind, sink_format, path + 1);
+        }
+        else if (strncmp(argv[i], "--watch=", 8) == 0){
+            watch_interval = atof(argv[i] + 8);
+            if (watch_interval <= 0){
+                printf("Invalid watch interval: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--leaks=", 8) == 0){
+            leak_interval = atof(argv[i] + 8);
+            if (leak_interval <= 0){
+                printf("Invalid sampling interval: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--samples=", 10) == 0){
+            leak_samples = atoi(argv[i] + 10);
+            if (leak_samples < 3 || leak_samples > LEAK_MAX_SAMPLES){
+                printf("Invalid sample count (3 to %d): %s\n", LEAK_MAX_SAMPLES, argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--open-by=", 10) == 0){
+            open_by = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--proc-root=", 12) == 0){
+            proc_root = argv[i] + 12;
+        }
+        else if (strncmp(argv[i], "--daemon=", 9) == 0){
+            daemon_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--refresh=", 10) == 0){
+            refresh_interval = atof(argv[i] + 10);
+            if (refresh_interval <= 0){
+                printf("Invalid refresh interval: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--query=", 8) == 0){
+            query_path = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--uid=", 6) == 0){
+            uid_arg = argv[i] + 6;
+        }
+        else if (strncmp(argv[i], "--comm=", 7) == 0){
+            comm_glob = argv[i] + 7;
+        }
+        else if (strncmp(argv[i], "--pid-list=", 11) == 0){
+            free(pid_list);
+            free(pid_order);
+            npid_list = parse_pid_list(argv[i] + 11, &pid_list, &pid_order);
+        }
+        else if (strncmp(argv[i], "--fd-type=", 10) == 0){
+            fd_types = parse_fd_types(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--path-prefix=", 14) == 0){
+            path_prefix = argv[i] + 14;
+        }
+        else if (strncmp(argv[i], "--format=", 9) == 0){
+            const char *name = argv[i] + 9;
+            if (strcmp(name, "text") == 0) format = OUT_TEXT;
+            else if (strcmp(name, "ndjson") == 0) format = OUT_NDJSON;
+            else if (strcmp(name, "csv") == 0) format = OUT_CSV;
+            else if (strcmp(name, "tsv") == 0) format = OUT_TSV;
+            else {
+                printf("Unknown format: %s\n", name);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--record=", 9) == 0){
+            record_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--keyframe=", 11) == 0){
+            keyframe_every = atoi(argv[i] + 11);
+            if (keyframe_every < 1){
+                printf("Invalid keyframe interval: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--replay=", 9) == 0){
+            replay_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--at=", 5) == 0){
+            replay_at = atof(argv[i] + 5);
+        }
+        else if (strncmp(argv[i], "--changes=", 10) == 0){
+            char *end;
+            replay_from = strtod(argv[i] + 10, &end);
+            replay_to = *end == ',' ? atof(end + 1) : -1;
+            if (end == argv[i] + 10 || (*end != ',' && *end != '\0')){
+                printf("Invalid time range: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--budget=", 9) == 0){
+            budget = atof(argv[i] + 9) / 1000;
+            if (budget <= 0){
+                printf("Invalid budget: %s\n", argv[i]);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(argv[i], "--summary=", 10) == 0){
+            nsummary_keys = parse_summary_keys(argv[i] + 10, summary_keys);
+        }
+        else if (strncmp(argv[i], "--columns=", 10) == 0){
+            ncolumns = parse_columns(argv[i] + 10, columns);
+        }
+        else if (strncmp(argv[i], "--read_binary=", 14) == 0){
+            read_binary = argv[i] + 14;
         }
         else{
             printf("Unknown argument: %s\n", argv[i]);
@@ -80,556 +1042,5210 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Default behavior
-    if (!(per_process || system_wide || vnodes || composite || save_text || save_binary)){
-        composite = 1;
+    // The opened/closed deltas of --watch only exist as text
+    if (format != OUT_TEXT && watch_interval > 0){
+        printf("--format cannot be combined with --watch\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (format != OUT_TEXT && leak_interval > 0){
+        printf("--format cannot be combined with --leaks\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // Saved snapshots and daemon replies carry only the fixed four columns
+    if (ncolumns > 0 && (watch_interval > 0 || leak_interval > 0 || read_binary != NULL || query_path != NULL
+                         || daemon_path != NULL)){
+        printf("--columns only applies to a composite table scanned from /proc\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // A history is only ever read as the composite table or as row deltas
+    if (replay_path != NULL && replay_at >= 0 && replay_from >= 0){
+        printf("--at and --changes cannot be combined\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (replay_from >= 0 && format != OUT_TEXT){
+        printf("--format cannot be combined with --changes\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // The budget bounds one scan; the other modes scan again and again
+    if (budget > 0 && (watch_interval > 0 || leak_interval > 0 || read_binary != NULL || query_path != NULL
+                       || daemon_path != NULL || record_path != NULL || replay_path != NULL)){
+        printf("--budget only applies to a single scan\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // A summary is a report of its own; --top=K keeps its K largest groups
+    if (nsummary_keys > 0 && (per_process || system_wide || vnodes || composite || nsinks > 0
+                              || threshold != -1 || open_by || ncolumns > 0 || watch_interval > 0 || leak_interval > 0
+                              || read_binary != NULL || query_path != NULL || daemon_path != NULL)){
+        printf("--summary cannot be combined with table views or other modes\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // All tables go through one buffered writer on stdout
+    out_stream out;
+    out_open(&out, STDOUT_FILENO, 1);
+    out.format = format;
+    if (ncolumns > 0){
+        out.columns = columns;
+        out.ncolumns = ncolumns;
+    }
+
+    // Rebuild the table at a point in time, or list what changed over a
+    // range, from a --record log
+    if (replay_path != NULL){
+        replay_history(&out, replay_path, pid, replay_at, replay_from, replay_to, replay_from >= 0);
+        out_close(&out);
+        if (format == OUT_TEXT){
+            printf("\n*******Program Terminated Successfuly!*******\n");
+        }
+        return 0;
+    }
+
+    // Print a saved snapshot instead of scanning /proc
+    if (read_binary != NULL){
+        read_composite_table_binary(&out, read_binary, pid);
+        out_close(&out);
+        if (format == OUT_TEXT){
+            printf("\n*******Program Terminated Successfuly!*******\n");
+        }
+        return 0;
+    }
+
+    // Counts by group instead of rows: aggregated while the scan streams
+    // (or once it is merged, for --jobs), then printed largest first
+    if (nsummary_keys > 0){
+        summary_state sum;
+        fd_snapshot snap;
+        scan_options opts;
+        summary_init(&sum, summary_keys, nsummary_keys, proc_root);
+        memset(&snap, 0, sizeof(snap));
+        memset(&opts, 0, sizeof(opts));
+        opts.proc_root = proc_root;
+        opts.pid = pid;
+        opts.need_inode = sum.need_inode;
+        opts.count_only = !sum.per_fd;
+        opts.jobs = jobs;
+        opts.use_ring = uring;
+        opts.timed = show_stats != 0;
+        opts.pid_list = pid_list;
+        opts.npid_list = npid_list;
+        opts.comm_glob = comm_glob;
+        opts.fd_types = fd_types;
+        opts.path_prefix = path_prefix;
+        opts.budget = budget;
+        opts.pid_order = pid_order;
+        if (fd_types || path_prefix != NULL){
+            opts.count_only = 0;
+        }
+        if (uid_arg != NULL){
+            opts.by_uid = 1;
+            opts.uid = parse_uid(uid_arg);
+        }
+        if (jobs == 1){
+            opts.emit = summary_add;
+            opts.emit_arg = &sum;
+        }
+
+        collect_or_exit(&snap, &opts);
+        if (jobs > 1){
+            summary_add(&snap, &sum);
+        }
+
+        phase_mark mark;
+        phase_start(&mark);
+        display_summary(&out, &sum, top);
+        if (budget > 0){
+            display_budget_report(&out, &snap, budget);
+        }
+        out_close(&out);
+        phase_stop(&snap.stats, PH_OUTPUT, &mark);
+        snap.stats.calls[SC_FSTATAT] += sum.uid_lookups;
+        if (show_stats){
+            print_scan_stats(&snap.stats, show_stats);
+        }
+        summary_free(&sum);
+        free_snapshot(&snap);
+        free(pid_list);
+        free(pid_order);
+        if (format == OUT_TEXT){
+            printf("\n*******Program Terminated Successfuly!*******\n");
+        }
+        return 0;
+    }
+
+    // Default behavior
+    if (!(per_process || system_wide || vnodes || composite || nsinks > 0 || top || open_by)){
+        composite = 1;
+    }
+
+    // Ask a running daemon instead of scanning; it serves the composite
+    // (or one PID's), threshold and open-by views
+    if (query_path != NULL){
+        display_from_daemon(&out, query_path, pid, composite, threshold, open_by);
+        out_close(&out);
+        if (format == OUT_TEXT){
+            printf("\n*******Program Terminated Successfuly!*******\n");
+        }
+        return 0;
+    }
+
+    // Scan /proc once; every table below renders from the same snapshot.
+    // The threshold and top-K checks look at all processes, so they widen
+    // the scan; on their own they only need fd counts, not link targets.
+    fd_snapshot snap;
+    scan_options opts;
+    memset(&snap, 0, sizeof(snap));
+    memset(&opts, 0, sizeof(opts));
+    opts.proc_root = proc_root;
+    opts.pid = (threshold != -1 || top) ? -1 : pid;
+    opts.need_inode = vnodes || composite || nsinks > 0;
+    opts.count_only = !(per_process || system_wide || opts.need_inode);
+    opts.jobs = jobs;
+    opts.sockets = sockets && (system_wide || composite);
+    opts.use_ring = uring;
+    for (int c = 0; c < ncolumns && (composite || open_by); c++){
+        if (columns[c] >= COL_POS) opts.fdinfo = 1;
+    }
+    opts.timed = show_stats != 0;
+    opts.pid_list = pid_list;
+    opts.npid_list = npid_list;
+    opts.comm_glob = comm_glob;
+    opts.fd_types = fd_types;
+    opts.path_prefix = path_prefix;
+    opts.budget = budget;
+    opts.pid_order = pid_order;
+    if (uid_arg != NULL){
+        opts.by_uid = 1;
+        opts.uid = parse_uid(uid_arg);
+    }
+    // Type and path filters need every link read, even for fd counts
+    if (fd_types || path_prefix != NULL){
+        opts.count_only = 0;
+    }
+
+    // A lone --open-by DEV:INODE query is pushed into the scan: only
+    // matching descriptors get their link read and kept
+    open_by_query query;
+    if (open_by != NULL){
+        parse_open_by(open_by, &query);
+        opts.count_only = 0;
+        if (!(per_process || system_wide || opts.need_inode || threshold != -1 || top) && query.by_inode
+            && !query.by_path){
+            opts.match_inode = 1;
+            opts.match_dev = query.dev;
+            opts.match_ino = query.ino;
+        }
+        opts.need_inode = 1;
+    }
+
+    // Resident mode: keep a full snapshot fresh and serve queries forever
+    if (daemon_path != NULL){
+        opts.pid = -1;
+        opts.need_inode = 1;
+        opts.count_only = 0;
+        opts.sockets = 0;
+        opts.match_inode = 0;
+        run_daemon(daemon_path, &opts, refresh_interval);
+    }
+
+    // Append a keyframe or a delta to a history log every interval, forever
+    if (record_path != NULL){
+        opts.need_inode = 1;
+        opts.count_only = 0;
+        opts.sockets = 0;
+        opts.match_inode = 0;
+        record_history(record_path, &opts, refresh_interval, keyframe_every);
+    }
+
+    // Leak detection: per-process fd counts sampled forever
+    if (leak_interval > 0){
+        opts.pid = pid;
+        opts.need_inode = 0;
+        opts.count_only = 1;
+        opts.sockets = 0;
+        opts.match_inode = 0;
+        track_leaks(&out, &opts, leak_interval, leak_samples);
+    }
+
+    // Incremental mode: baseline table, then opened/closed deltas forever
+    if (watch_interval > 0){
+        opts.pid = pid;
+        opts.need_inode = 1;
+        opts.count_only = 0;
+        watch_descriptors(&out, &opts, watch_interval, show_stats);
+    }
+
+    // A composite table on its own needs no snapshot: each process's rows
+    // are written as soon as it has been scanned, and then dropped
+    int stream = composite && jobs == 1 && !(per_process || system_wide || vnodes || nsinks > 0
+                                             || threshold != -1 || top || open_by);
+    if (stream){
+        opts.emit = emit_composite_rows;
+        opts.emit_arg = &out;
+        composite_header(&out, opts.sockets);
+    }
+
+    collect_or_exit(&snap, &opts);
+
+    // The files are written while the screen output is rendered
+    phase_mark mark, save_mark;
+    phase_start(&save_mark);
+    start_sinks(sinks, nsinks, &snap, pid);
+
+    // Display requested tables
+    phase_start(&mark);
+    if (per_process){
+        display_process_fd_table(&out, &snap, pid);
+    }
+    if (system_wide){
+        display_systemwide_fd_table(&out, &snap, pid);
+    }
+    if (vnodes){
+        display_vnodes_fd_table(&out, &snap, pid);
+    }
+    if (stream){
+        composite_footer(&out);
+    }
+    else if (composite){
+        display_composed_table(&out, &snap, pid);
+    }
+
+    // Flag offending processes if threshold is provided
+    if (threshold != -1){
+        flag_offending_processes(&out, &snap, threshold);
+    }
+    if (top){
+        display_top_processes(&out, &snap, top);
+    }
+    if (open_by != NULL){
+        display_open_by(&out, &snap, &query);
+    }
+    if (budget > 0){
+        display_budget_report(&out, &snap, budget);
+    }
+    out_close(&out);
+    phase_stop(&snap.stats, PH_OUTPUT, &mark);
+
+    // Wait for --output_TXT, --output_binary and --output files
+    finish_sinks(sinks, nsinks);
+    phase_stop(&snap.stats, PH_SAVE, &save_mark);
+
+    if (show_stats){
+        print_scan_stats(&snap.stats, show_stats);
+    }
+
+    free_snapshot(&snap);
+    free(pid_list);
+    free(pid_order);
+
+    // Keep machine-readable output parseable to the last line
+    if (format == OUT_TEXT){
+        printf("\n*******Program Terminated Successfuly!*******\n");
+    }
+
+    return 0;
+}
+#endif
+
+fdt_scanner *fdt_open(const char *proc_root) {
+    if (proc_root == NULL) {
+        proc_root = "/proc";
+    }
+    // Fail here, where the caller can handle it, rather than in a scan
+    int proc_fd = open(proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_fd == -1) {
+        return NULL;
+    }
+    close(proc_fd);
+
+    fdt_scanner *scanner = calloc(1, sizeof(fdt_scanner));
+    if (scanner == NULL || (scanner->proc_root = strdup(proc_root)) == NULL) {
+        free(scanner);
+        return NULL;
+    }
+    return scanner;
+}
+
+ssize_t fdt_scan(fdt_scanner *scanner, pid_t pid, int flags, fdt_callback callback, void *arg) {
+    // A streamed serial scan: the snapshot holds one process at a time and
+    // its arrays and arena are reused for the next
+    scan_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.proc_root = scanner->proc_root;
+    opts.pid = pid;
+    opts.need_inode = (flags & FDT_STAT) != 0;
+    opts.jobs = 1;
+    opts.emit = deliver_records;
+    opts.emit_arg = scanner;
+
+    scanner->callback = callback;
+    scanner->arg = arg;
+    scanner->delivered = 0;
+
+    if (collect_snapshot(&scanner->snap, &opts) == -1) {
+        return -1;
+    }
+    if (scanner->snap.pid_error != 0) {
+        errno = scanner->snap.pid_error;
+        return -1;
+    }
+    return (ssize_t)scanner->delivered;
+}
+
+void fdt_close(fdt_scanner *scanner) {
+    if (scanner == NULL) {
+        return;
+    }
+    free_snapshot(&scanner->snap);
+    free(scanner->proc_root);
+    free(scanner);
+}
+
+// emit hook behind fdt_scan: present each record as an fdt_record
+void deliver_records(const fd_snapshot *snap, void *arg) {
+    fdt_scanner *scanner = arg;
+    fdt_record out;
+
+    for (size_t i = 0; i < snap->count; i++) {
+        const fd_record *rec = &snap->records[i];
+        out.pid = rec->pid;
+        out.fd = rec->fd;
+        out.target = rec->target;
+        out.target_len = strlen(rec->target);
+        out.has_target = rec->has_target;
+        out.has_stat = rec->has_inode;
+        out.inode = rec->inode;
+        out.dev = rec->dev;
+        out.mode = rec->mode;
+        scanner->callback(&out, scanner->arg);
+    }
+    scanner->delivered += snap->count;
+}
+
+// collect_snapshot for the command line: a PID that does not exist (any
+// more) just yields an empty table, any other failure ends the program
+void collect_or_exit(fd_snapshot *snap, const scan_options *opts) {
+    if (collect_snapshot(snap, opts) == -1) {
+        perror("Error scanning /proc directory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (snap->pid_error != 0 && snap->pid_error != ENOENT) {
+        errno = snap->pid_error;
+        perror("Error opening directory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Scan into snap, which is either zeroed or a snapshot from an earlier scan:
+// its record arrays and string arena are reused rather than reallocated.
+// Returns -1 with errno set when the proc root cannot be opened or read or
+// memory runs out, having closed and freed whatever the scan opened; snap
+// then holds what was gathered so far. A single PID that cannot be read is
+// left in snap->pid_error.
+int collect_snapshot(fd_snapshot *snap, const scan_options *scan_opts) {
+    phase_mark mark;
+    reset_snapshot(snap);
+    snap->scanned = time(NULL);
+    double started = now_seconds();
+
+    // Every per-process lookup below is resolved relative to this handle
+    int proc_fd = open(scan_opts->proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    snap->stats.calls[SC_OPENAT]++;
+    if (proc_fd == -1) {
+        return -1;
+    }
+
+    scan_options run = *scan_opts;
+    const scan_options *opts = &run;
+    if (run.budget > 0) {
+        run.deadline = started + run.budget;
+    }
+    if (run.count_only) {
+        run.size_counts = kernel_reports_fd_counts(proc_fd);
+        snap->stats.calls[SC_FSTATAT]++;
+    }
+
+    // Serial scans share one ring; parallel workers each open their own
+    stat_ring *ring = NULL;
+    if (opts->use_ring && opts->need_inode && !(opts->pid == -1 && opts->jobs > 1)) {
+        ring = stat_ring_open();
+    }
+
+    // Streamed rows are annotated as they go out, so sockets come first
+    if (opts->sockets && opts->emit != NULL) {
+        phase_start(&mark);
+        snap->sockets = load_socket_table(opts->proc_root, &snap->stats);
+        phase_stop(&snap->stats, PH_SOCKETS, &mark);
+    }
+
+    int rc = 0, err = 0;
+    if (opts->pid != -1){ // PID is specified
+        phase_start(&mark);
+        rc = collect_pid(snap, proc_fd, opts->pid, opts, ring, 0);
+        err = errno;
+        if (rc == 1) {
+            snap->pid_error = errno;
+            rc = 0;
+        }
+        if (rc == 0 && opts->emit != NULL) {
+            emit_and_drop(snap, opts);
+        }
+        phase_stop(&snap->stats, PH_WALK, &mark);
+    }
+    else {
+        pid_t *pids = NULL;
+        ssize_t npids;
+        phase_start(&mark);
+        if (opts->pid_list != NULL) {
+            // Only the listed PIDs can match: don't enumerate /proc at all
+            npids = (ssize_t)opts->npid_list;
+            pids = malloc((opts->npid_list + 1) * sizeof(pid_t));
+            if (pids == NULL) {
+                npids = -1;
+            }
+            else {
+                memcpy(pids, opts->deadline ? opts->pid_order : opts->pid_list, npids * sizeof(pid_t));
+            }
+        }
+        else {
+            npids = list_pids(proc_fd, &pids, &snap->stats);
+            // Under a budget the biggest fd tables go first
+            if (npids > 0 && opts->deadline) {
+                order_by_fd_count(proc_fd, pids, (size_t)npids, &snap->stats);
+            }
+        }
+        if (npids > 0 && opts->deadline && opts->jobs > 1) {
+            interleave_pids(pids, (size_t)npids, opts->jobs);
+        }
+        phase_stop(&snap->stats, PH_LIST, &mark);
+
+        phase_start(&mark);
+        if (npids == -1) {
+            rc = -1;
+        }
+        else if (opts->jobs > 1 && npids > 1) {
+            rc = collect_parallel(snap, proc_fd, pids, (size_t)npids, opts);
+        }
+        else if (opts->emit == NULL) {
+            table_index index;
+            memset(&index, 0, sizeof(index));
+            index.disabled = opts->count_only || strcmp(opts->proc_root, "/proc") != 0;
+            for (ssize_t i = 0; i < npids && rc != -1; i++) {
+                rc = collect_pid_shared(snap, proc_fd, pids[i], opts, ring, &index);
+            }
+            free(index.tables);
+        }
+        else {
+            // Records are dropped as they are streamed, so there is
+            // nothing to copy a shared table from: every process is
+            // walked (see collect_pid_shared)
+            for (ssize_t i = 0; i < npids && rc != -1; i++) {
+                rc = collect_pid(snap, proc_fd, pids[i], opts, ring, 0);
+                if (rc != -1) {
+                    emit_and_drop(snap, opts);
+                }
+            }
+        }
+        err = errno;
+        phase_stop(&snap->stats, PH_WALK, &mark);
+        free(pids);
+    }
+
+    close(proc_fd);
+    snap->stats.calls[SC_CLOSE]++;
+    stat_ring_close(ring);
+    if (rc == -1) {
+        errno = err;
+        return -1;
+    }
+
+    // Read the socket tables right after the walk so sockets the scan saw
+    // being created are already listed
+    if (opts->sockets && opts->emit == NULL) {
+        phase_start(&mark);
+        snap->sockets = load_socket_table(opts->proc_root, &snap->stats);
+        phase_stop(&snap->stats, PH_SOCKETS, &mark);
+    }
+    snap->stats.scan_seconds = now_seconds() - started;
+    return 0;
+}
+
+// Hand the records gathered so far to opts->emit, then forget them
+void emit_and_drop(fd_snapshot *snap, const scan_options *opts) {
+    opts->emit(snap, opts->emit_arg);
+    snap->count = 0;
+    snap->nprocs = 0;
+    arena_reset(&snap->strings);
+}
+
+// Enumerate the numeric entries of /proc, in readdir order. No per-PID probe
+// is made here: a process we may not inspect fails when its fd dir is opened.
+// Returns the count, or -1 with errno set (and *pids NULL) when /proc can't
+// be read or memory runs out.
+ssize_t list_pids(int proc_fd, pid_t **pids, scan_stats *stats) {
+    char buf[DENTS_BUF_LEN];
+    size_t count = 0, capacity = 256;
+    long nread;
+
+    *pids = malloc(capacity * sizeof(pid_t));
+    if (*pids == NULL) {
+        return -1;
+    }
+
+    while ((nread = syscall(SYS_getdents64, proc_fd, buf, sizeof(buf))) > 0) {
+        stats->calls[SC_GETDENTS]++;
+        for (long off = 0; off < nread; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+
+            // Skip non-process directories
+            if (!isdigit((unsigned char)d->d_name[0])) continue;
+
+            if (count == capacity) {
+                capacity *= 2;
+                pid_t *grown = realloc(*pids, capacity * sizeof(pid_t));
+                if (grown == NULL) {
+                    free(*pids);
+                    *pids = NULL;
+                    return -1;
+                }
+                *pids = grown;
+            }
+            (*pids)[count++] = atoi(d->d_name);
+        }
+    }
+    stats->calls[SC_GETDENTS]++; // the final call that returned 0 (or failed)
+    if (nread == -1) {
+        int err = errno;
+        note_failure(stats, SC_GETDENTS);
+        free(*pids);
+        *pids = NULL;
+        errno = err;
+        return -1;
+    }
+    return (ssize_t)count;
+}
+
+// Scan one process through a single handle on /proc/<pid>/fd: entries come
+// from getdents64 and each link is resolved with readlinkat against that
+// handle. Count-only scans stop at the getdents64 pass, or at a single
+// fstatat when the kernel reports the count as the directory size.
+// Returns 1 with errno set when the fd directory cannot be read
+// (EACCES: not ours to inspect, ENOENT: the process exited), and -1 with
+// errno set when the scan cannot go on (out of memory).
+// With a ring, the fd link stats of each getdents64 batch are gathered in
+// pending and issued together once the batch has been walked.
+int collect_pid(fd_snapshot *snap, int proc_fd, pid_t pid, const scan_options *opts, stat_ring *ring,
+                int selected) {
+    char buf[DENTS_BUF_LEN];
+    size_t pending[DENTS_BUF_LEN / sizeof(struct linux_dirent64) + 1];
+    int pending_errs[DENTS_BUF_LEN / sizeof(struct linux_dirent64) + 1];
+    size_t npending = 0;
+    int batched = ring != NULL && opts->need_inode;
+    char fd_dir_name[32];
+    long nread;
+    int links_denied = 0;
+    unsigned long nfds = 0;
+    char *link = NULL;
+    size_t link_size = 0;
+    double pid_started = opts->timed ? now_seconds() : 0;
+    int filter_fds = opts->fd_types || opts->path_prefix != NULL;
+    int cut_short = 0;
+    int failed = 0;
+    size_t first = snap->count;
+
+    if (opts->deadline && now_seconds() >= opts->deadline) {
+        return pid_array_push(&snap->skipped, pid);
+    }
+
+    if (!selected && !pid_selected(proc_fd, pid, opts, &snap->stats)) {
+        snap->stats.filtered_pids++;
+        return 0;
+    }
+
+    snprintf(fd_dir_name, sizeof(fd_dir_name), "%d/fd", pid);
+
+    if (opts->count_only && opts->size_counts) {
+        // stat() of the fd directory succeeds for anyone, so ask the same
+        // question the openat below would (counted as an openat, since it
+        // stands in for one): a process we may not list is not counted
+        struct stat st;
+        snap->stats.calls[SC_OPENAT]++;
+        if (faccessat(proc_fd, fd_dir_name, R_OK, AT_EACCESS) == -1) {
+            note_failure(&snap->stats, SC_OPENAT);
+            return 1;
+        }
+        snap->stats.calls[SC_FSTATAT]++;
+        if (fstatat(proc_fd, fd_dir_name, &st, 0) == -1) {
+            note_failure(&snap->stats, SC_FSTATAT);
+            return 1;
+        }
+        snap->stats.processes++;
+        snap->stats.descriptors += st.st_size;
+        if (append_proc_count(snap, pid, (unsigned long)st.st_size) == -1) {
+            return -1;
+        }
+        return opts->deadline ? pid_array_push(&snap->covered, pid) : 0;
+    }
+
+    int fd_dirfd = openat(proc_fd, fd_dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    snap->stats.calls[SC_OPENAT]++;
+    if (fd_dirfd == -1) {
+        note_failure(&snap->stats, SC_OPENAT);
+        return 1;
+    }
+    snap->stats.processes++;
+
+    // Traverse each file descriptor entry
+    while ((nread = syscall(SYS_getdents64, fd_dirfd, buf, sizeof(buf))) > 0) {
+        snap->stats.calls[SC_GETDENTS]++;
+        // Out of budget halfway through: keep the rows read so far, which
+        // under a budget are the biggest tables' first, and report the
+        // process as partial. With none read yet it is simply skipped.
+        if (opts->deadline && now_seconds() >= opts->deadline) {
+            if (nfds > 0) {
+                cut_short = 1;
+                break;
+            }
+            snap->stats.processes--;
+            close(fd_dirfd);
+            snap->stats.calls[SC_CLOSE]++;
+            free(link);
+            return pid_array_push(&snap->skipped, pid);
+        }
+        size_t batch_start = snap->count;
+        npending = 0;
+        for (long off = 0; off < nread; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+
+            // Skip "." and ".." entries
+            if (d->d_name[0] == '.') continue;
+
+            nfds++;
+            snap->stats.descriptors++;
+            if (opts->count_only) continue;
+
+            fd_record *rec = append_record(snap);
+            if (rec == NULL) {
+                failed = 1;
+                break;
+            }
+            rec->pid = pid;
+            rec->fd = atoi(d->d_name);
+
+            // Once the kernel refuses one link of this process it will refuse
+            // them all, so stop asking. A filtered scan can't classify what
+            // it can't read, so there those descriptors are dropped.
+            if (links_denied) {
+                if (filter_fds) {
+                    snap->count--;
+                    nfds--;
+                    snap->stats.filtered_fds++;
+                }
+                continue;
+            }
+            double fd_started = opts->timed ? now_seconds() : 0;
+
+            // Type and path filters only need the link target, so with them
+            // the link is read first and only the survivors are stat-ed
+            if (filter_fds) {
+                int rc = resolve_target(snap, fd_dirfd, d->d_name, rec, &link, &link_size, opts, fd_started);
+                if (rc == -1) {
+                    failed = 1;
+                    break;
+                }
+                if (rc != 0) {
+                    if (rc == 2 && (errno == EACCES || errno == EPERM)) {
+                        links_denied = 1;
+                    }
+                    snap->count--;
+                    nfds--;
+                    snap->stats.filtered_fds++;
+                    continue;
+                }
+                if (batched) {
+                    pending[npending++] = snap->count - 1;
+                    continue;
+                }
+                if (opts->need_inode && resolve_inode(snap, fd_dirfd, d->d_name, rec, opts) == -1
+                    && (errno == EACCES || errno == EPERM)) {
+                    links_denied = 1;
+                }
+                if (opts->match_inode && !(rec->has_inode && rec->dev == opts->match_dev
+                                           && rec->inode == opts->match_ino)) {
+                    snap->count--;
+                }
+                continue;
+            }
+
+            // Get inode of the file, only when some view is going to print it.
+            // Stat through the fd link itself rather than the target path:
+            // this never walks a (possibly hung) remote mount by name, and
+            // it works for socket:[...], pipe:[...] and anon_inode: too.
+            // It runs before readlinkat so an --open-by scan can drop the
+            // descriptors that don't match without reading their links.
+            if (batched) {
+                // An --open-by scan reads links after the stats, for the
+                // matches only
+                if (!opts->match_inode) {
+                    int rc = resolve_target(snap, fd_dirfd, d->d_name, rec, &link, &link_size, opts, fd_started);
+                    if (rc == -1) {
+                        failed = 1;
+                        break;
+                    }
+                    if (rc == 2 && (errno == EACCES || errno == EPERM)) {
+                        links_denied = 1;
+                    }
+                }
+                pending[npending++] = snap->count - 1;
+                continue;
+            }
+            if (opts->need_inode) {
+                if (resolve_inode(snap, fd_dirfd, d->d_name, rec, opts) == -1
+                    && (errno == EACCES || errno == EPERM)) {
+                    links_denied = 1;
+                    continue;
+                }
+                if (opts->match_inode && !(rec->has_inode && rec->dev == opts->match_dev
+                                           && rec->inode == opts->match_ino)) {
+                    snap->count--;
+                    continue;
+                }
+            }
+
+            // Read the symbolic link to get the file name
+            int rc = resolve_target(snap, fd_dirfd, d->d_name, rec, &link, &link_size, opts, fd_started);
+            if (rc == -1) {
+                failed = 1;
+                break;
+            }
+            if (rc == 2 && (errno == EACCES || errno == EPERM)) {
+                links_denied = 1;
+            }
+        }
+        if (failed) {
+            break;
+        }
+
+        if (npending > 0) {
+            resolve_pending(snap, ring, fd_dirfd, pending, npending, pending_errs, opts);
+            for (size_t i = 0; i < npending; i++) {
+                if (pending_errs[i] == EACCES || pending_errs[i] == EPERM) {
+                    links_denied = 1;
+                }
+            }
+            if (opts->match_inode) {
+                // Drop the batch's non-matching records as the synchronous
+                // path would have, then read the links of the rest
+                size_t kept = batch_start, p = 0;
+                for (size_t r = batch_start; r < snap->count; r++) {
+                    fd_record *rec = &snap->records[r];
+                    int was_pending = p < npending && pending[p] == r;
+                    int denied = was_pending && (pending_errs[p] == EACCES || pending_errs[p] == EPERM);
+                    if (was_pending) p++;
+                    if (was_pending && !denied && !(rec->has_inode && rec->dev == opts->match_dev
+                                                    && rec->inode == opts->match_ino)) {
+                        continue;
+                    }
+                    snap->records[kept++] = *rec;
+                }
+                snap->count = kept;
+                for (size_t r = batch_start; r < snap->count && !filter_fds; r++) {
+                    fd_record *rec = &snap->records[r];
+                    if (!rec->has_inode || links_denied) continue;
+                    char name[16];
+                    snprintf(name, sizeof(name), "%d", rec->fd);
+                    int rc = resolve_target(snap, fd_dirfd, name, rec, &link, &link_size, opts, 0);
+                    if (rc == -1) {
+                        failed = 1;
+                        break;
+                    }
+                    if (rc == 2 && (errno == EACCES || errno == EPERM)) {
+                        links_denied = 1;
+                    }
+                }
+                if (failed) {
+                    break;
+                }
+            }
+        }
+    }
+    if (!cut_short && !failed) {
+        snap->stats.calls[SC_GETDENTS]++; // the final call that returned 0 (or failed)
+    }
+
+    if (nread == -1) {
+        note_failure(&snap->stats, SC_GETDENTS);
+    }
+
+    int err = errno;
+    close(fd_dirfd);
+    snap->stats.calls[SC_CLOSE]++;
+    free(link);
+    if (failed) {
+        errno = err;
+        return -1;
+    }
+    if (opts->fdinfo && resolve_fdinfo(snap, proc_fd, pid, first) == -1) {
+        return -1;
+    }
+    if (append_proc_count(snap, pid, nfds) == -1) {
+        return -1;
+    }
+    if (opts->deadline && pid_array_push(cut_short ? &snap->partial : &snap->covered, pid) == -1) {
+        return -1;
+    }
+    if (opts->timed) {
+        note_slow_pid(&snap->stats, pid, nfds, now_seconds() - pid_started);
+    }
+    return 0;
+}
+
+// collect_pid, unless pid shares its fd table with a process index has
+// already seen: then that table's records are copied under pid. New
+// tables are added to index. For count-only scans, on kernels without
+// kcmp, or on a synthetic tree (whose PIDs kcmp can't see) this is plain
+// collect_pid. Copying needs the rows of the first process kept in the
+// snapshot, so scans that stream rows and drop them (--summary, or
+// --composite with no other table, --threshold, --top, --open-by or
+// --output) have no index and walk every process unless run with --jobs.
+int collect_pid_shared(fd_snapshot *snap, int proc_fd, pid_t pid, const scan_options *opts, stat_ring *ring,
+                       table_index *index) {
+    size_t slot;
+    if (index->disabled) {
+        return collect_pid(snap, proc_fd, pid, opts, ring, 0);
+    }
+
+    // The process-level filters first: they are cheaper than the kcmp
+    // calls of the search, and hold per process even when the table is
+    // shared
+    if (!pid_selected(proc_fd, pid, opts, &snap->stats)) {
+        snap->stats.filtered_pids++;
+        return 0;
+    }
+
+    int found = find_shared_table(index, pid, &slot, &snap->stats);
+    if (found == 1) {
+        if (copy_shared_table(snap, &index->tables[slot], pid) == -1) {
+            return -1;
+        }
+        return opts->deadline ? pid_array_push(&snap->covered, pid) : 0;
+    }
+
+    size_t first = snap->count;
+    size_t nprocs = snap->nprocs;
+    size_t npartial = snap->partial.count;
+    int rc = collect_pid(snap, proc_fd, pid, opts, ring, 1);
+    // Only a table that was walked to the end can be copied later, and
+    // only from a process kcmp lets us compare: one that refuses would
+    // break every search that passes through it
+    if (found == -1 || rc != 0 || snap->nprocs == nprocs || snap->partial.count != npartial) {
+        return rc;
+    }
+    snap->stats.calls[SC_KCMP]++;
+    if (syscall(SYS_kcmp, pid, pid, KCMP_FILES, 0, 0) != 0) {
+        note_failure(&snap->stats, SC_KCMP);
+        return rc;
+    }
+
+    if (index->count == index->capacity) {
+        size_t new_capacity = index->capacity ? index->capacity * 2 : 64;
+        shared_table *grown = realloc(index->tables, new_capacity * sizeof(shared_table));
+        if (grown == NULL) {
+            return rc; // the table is only an optimisation: go on without it
+        }
+        index->tables = grown;
+        index->capacity = new_capacity;
+    }
+    memmove(&index->tables[slot + 1], &index->tables[slot], (index->count - slot) * sizeof(shared_table));
+    index->tables[slot].pid = pid;
+    index->tables[slot].snap = snap;
+    index->tables[slot].first = first;
+    index->tables[slot].count = snap->count - first;
+    index->tables[slot].fds = snap->procs[snap->nprocs - 1].fds;
+    index->count++;
+    return rc;
+}
+
+// Binary search of index for pid's fd table. Returns 1 with *slot set when
+// a process sharing it was scanned, 0 with *slot at the insertion point,
+// or -1 when kcmp failed (pid exited, or we may not ptrace it). Indexed
+// processes that have exited since they were walked are dropped on the way.
+int find_shared_table(table_index *index, pid_t pid, size_t *slot, scan_stats *stats) {
+    size_t lo = 0, hi = index->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        pid_t other = index->tables[mid].pid;
+        long order = syscall(SYS_kcmp, pid, other, KCMP_FILES, 0, 0);
+        stats->calls[SC_KCMP]++;
+        if (order == -1) {
+            note_failure(stats, SC_KCMP);
+            if (errno == ENOSYS) {
+                index->disabled = 1;
+                return -1;
+            }
+            if (errno != ESRCH) {
+                return -1;
+            }
+            // ESRCH names either process: if it was the indexed one, forget
+            // its table and search again
+            stats->calls[SC_KCMP]++;
+            if (syscall(SYS_kcmp, other, other, KCMP_FILES, 0, 0) == 0 || errno != ESRCH) {
+                return -1;
+            }
+            note_failure(stats, SC_KCMP);
+            memmove(&index->tables[mid], &index->tables[mid + 1],
+                    (index->count - mid - 1) * sizeof(shared_table));
+            index->count--;
+            lo = 0;
+            hi = index->count;
+            continue;
+        }
+        if (order == 0) {
+            *slot = mid;
+            return 1;
+        }
+        // 1: pid's table orders before mid's, 2: after
+        if (order == 1) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    *slot = lo;
+    return 0;
+}
+
+// The records of a shared table, attributed to pid. Strings are interned
+// again when the table lives in another snapshot, whose arena may be freed
+// before this one. Returns -1 with errno set when memory runs out.
+int copy_shared_table(fd_snapshot *snap, const shared_table *table, pid_t pid) {
+    for (size_t i = 0; i < table->count; i++) {
+        fd_record *rec = append_record(snap);
+        if (rec == NULL) {
+            return -1;
+        }
+        *rec = table->snap->records[table->first + i];
+        rec->pid = pid;
+        if (table->snap != snap) {
+            rec->target = arena_intern(&snap->strings, rec->target);
+            rec->extra = arena_intern(&snap->strings, rec->extra);
+            if (rec->target == NULL || rec->extra == NULL) {
+                snap->count--;
+                return -1;
+            }
+        }
+    }
+    snap->stats.processes++;
+    snap->stats.descriptors += table->fds;
+    snap->stats.shared_pids++;
+    return append_proc_count(snap, pid, table->fds);
+}
+
+// PID-level filters, cheapest first and all decided before the fd directory
+// is opened: the --pid-list lookup is free, --uid costs one fstatat of
+// /proc/<pid> (owned by the process's effective uid) and --comm one read
+// of /proc/<pid>/comm
+int pid_selected(int proc_fd, pid_t pid, const scan_options *opts, scan_stats *stats) {
+    char path[32];
+
+    if (opts->pid_list != NULL
+        && bsearch(&pid, opts->pid_list, opts->npid_list, sizeof(pid_t), compare_pid) == NULL) {
+        return 0;
+    }
+
+    if (opts->by_uid) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%d", pid);
+        stats->calls[SC_FSTATAT]++;
+        if (fstatat(proc_fd, path, &st, 0) == -1) {
+            note_failure(stats, SC_FSTATAT);
+            return 0;
+        }
+        if (st.st_uid != opts->uid) return 0;
+    }
+
+    if (opts->comm_glob != NULL) {
+        char comm[64];
+        snprintf(path, sizeof(path), "%d/comm", pid);
+        int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+        stats->calls[SC_OPENAT]++;
+        if (fd == -1) {
+            note_failure(stats, SC_OPENAT);
+            return 0;
+        }
+        ssize_t n = read(fd, comm, sizeof(comm) - 1);
+        stats->calls[SC_READ]++;
+        if (n == -1) {
+            note_failure(stats, SC_READ);
+        }
+        close(fd);
+        stats->calls[SC_CLOSE]++;
+        if (n <= 0) return 0;
+
+        comm[n] = '\0';
+        if (comm[n - 1] == '\n') comm[n - 1] = '\0';
+        if (fnmatch(opts->comm_glob, comm, 0) != 0) return 0;
+    }
+    return 1;
+}
+
+// Classify a descriptor by its link target alone, without a stat
+int fd_type_of(const char *target) {
+    if (strncmp(target, "socket:[", 8) == 0) return FD_TYPE_SOCKET;
+    if (strncmp(target, "pipe:[", 6) == 0) return FD_TYPE_PIPE;
+    if (strncmp(target, "anon_inode:", 11) == 0) return FD_TYPE_ANON;
+    return FD_TYPE_FILE;
+}
+
+int target_selected(const char *target, const scan_options *opts) {
+    if (opts->fd_types && !(opts->fd_types & fd_type_of(target))) return 0;
+    if (opts->path_prefix != NULL && strncmp(target, opts->path_prefix, strlen(opts->path_prefix)) != 0) return 0;
+    return 1;
+}
+
+// Parse "file,socket,pipe,anon" into FD_TYPE_* bits
+int parse_fd_types(const char *list) {
+    static const struct { const char *name; int type; } types[] = {
+        {"file", FD_TYPE_FILE},
+        {"socket", FD_TYPE_SOCKET},
+        {"pipe", FD_TYPE_PIPE},
+        {"anon", FD_TYPE_ANON},
+    };
+    int mask = 0;
+
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        size_t t;
+        for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+            if (strlen(types[t].name) == len && strncmp(list, types[t].name, len) == 0) break;
+        }
+        if (t == sizeof(types) / sizeof(types[0])) {
+            printf("Unknown fd type: %.*s\n", (int)len, list);
+            display_usage();
+            exit(EXIT_FAILURE);
+        }
+        mask |= types[t].type;
+        list += len;
+        if (*list == ',') list++;
+    }
+    return mask;
+}
+
+// A numeric UID, or a user name looked up in the password database
+uid_t parse_uid(const char *arg) {
+    if (isPid((char *)arg) && arg[0] != '\0') {
+        return (uid_t)atoi(arg);
+    }
+    struct passwd *pw = getpwnam(arg);
+    if (pw == NULL) {
+        printf("Unknown user: %s\n", arg);
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+    return pw->pw_uid;
+}
+
+// Parse "pid,fd,pos,..." into COL_* ids in the order given; returns the count
+int parse_columns(const char *list, int *columns) {
+    static const char *names[COL_KINDS] = {"pid", "fd", "filename", "inode", "pos", "flags", "mnt_id", "extra"};
+    int count = 0;
+
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        int c;
+        for (c = 0; c < COL_KINDS; c++) {
+            if (strlen(names[c]) == len && strncmp(list, names[c], len) == 0) break;
+        }
+        if (c == COL_KINDS) {
+            printf("Unknown column: %.*s\n", (int)len, list);
+            display_usage();
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < count; k++) {
+            if (columns[k] == c) {
+                printf("Duplicate column: %.*s\n", (int)len, list);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        columns[count++] = c;
+        list += len;
+        if (*list == ',') list++;
+    }
+    if (count == 0) {
+        printf("No columns given\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
+
+// Read fdinfo for the records collect_pid kept for pid (from index first
+// on), through one handle on /proc/<pid>/fdinfo. Runs after the filters
+// and --open-by have dropped what won't be shown, so each printed row
+// costs one open/read/close more and nothing else does.
+int resolve_fdinfo(fd_snapshot *snap, int proc_fd, pid_t pid, size_t first) {
+    char dir_name[32];
+    char name[16];
+    char info[FDINFO_BUF_LEN];
+    int rc = 0;
+
+    if (first == snap->count) return 0;
+
+    snprintf(dir_name, sizeof(dir_name), "%d/fdinfo", pid);
+    int info_dirfd = openat(proc_fd, dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    snap->stats.calls[SC_OPENAT]++;
+    if (info_dirfd == -1) {
+        note_failure(&snap->stats, SC_OPENAT);
+        return 0;
+    }
+
+    for (size_t i = first; i < snap->count && rc == 0; i++) {
+        fd_record *rec = &snap->records[i];
+        if (!rec->has_target || !rec->has_inode) continue;  // no row to fill
+
+        snprintf(name, sizeof(name), "%d", rec->fd);
+        int fd = openat(info_dirfd, name, O_RDONLY | O_CLOEXEC);
+        snap->stats.calls[SC_OPENAT]++;
+        if (fd == -1) {
+            note_failure(&snap->stats, SC_OPENAT);
+            continue;
+        }
+        ssize_t n = read(fd, info, sizeof(info) - 1);
+        snap->stats.calls[SC_READ]++;
+        if (n == -1) {
+            note_failure(&snap->stats, SC_READ);
+        }
+        close(fd);
+        snap->stats.calls[SC_CLOSE]++;
+        if (n <= 0) continue;
+
+        info[n] = '\0';
+        rc = parse_fdinfo(snap, rec, info);
+    }
+
+    int err = errno;
+    close(info_dirfd);
+    snap->stats.calls[SC_CLOSE]++;
+    errno = err;
+    return rc;
+}
+
+// pos:, flags: and mnt_id: are common to every descriptor; ino: repeats the
+// inode column. Anything else (eventfd-count, epoll tfd, inotify wd, lock,
+// ...) is kept as the extra column, its padding squeezed to single spaces.
+// A line cut off by the end of the buffer is dropped, and the extra column
+// stops at FDINFO_BUF_LEN.
+int parse_fdinfo(fd_snapshot *snap, fd_record *rec, const char *info) {
+    char extra[FDINFO_BUF_LEN];
+    size_t extra_len = 0;
+
+    rec->pos = 0;
+    rec->flags = 0;
+    rec->mnt_id = 0;
+    for (const char *line = info; *line != '\0'; ) {
+        const char *eol = strchr(line, '\n');
+        if (eol == NULL) break;
+
+        if (strncmp(line, "pos:", 4) == 0) {
+            rec->pos = strtoll(line + 4, NULL, 10);
+        }
+        else if (strncmp(line, "flags:", 6) == 0) {
+            rec->flags = (unsigned int)strtoul(line + 6, NULL, 8);
+        }
+        else if (strncmp(line, "mnt_id:", 7) == 0) {
+            rec->mnt_id = atoi(line + 7);
+        }
+        else if (strncmp(line, "ino:", 4) != 0 && eol > line) {
+            // Separators count against the buffer too, so check every write
+            if (extra_len > 0) {
+                if (extra_len + 2 >= sizeof(extra)) break;
+                memcpy(extra + extra_len, "; ", 2);
+                extra_len += 2;
+            }
+            for (const char *p = line; p < eol && extra_len + 1 < sizeof(extra); p++) {
+                int space = *p == ' ' || *p == '\t';
+                if (space && extra_len > 0 && extra[extra_len - 1] == ' ') continue;
+                extra[extra_len++] = space ? ' ' : *p;
+            }
+        }
+        line = eol + 1;
+    }
+    extra[extra_len] = '\0';
+    const char *copy = arena_intern(&snap->strings, extra);
+    if (copy == NULL) {
+        return -1;
+    }
+    rec->extra = copy;
+    rec->has_fdinfo = 1;
+    return 0;
+}
+
+// Parse "1,20,300" into a sorted array for bsearch, and into *order as
+// given; returns the count
+size_t parse_pid_list(const char *list, pid_t **pids, pid_t **order) {
+    size_t count = 0, capacity = 16;
+    *pids = malloc(capacity * sizeof(pid_t));
+    if (*pids == NULL) {
+        perror("Error allocating PID list");
+        exit(EXIT_FAILURE);
+    }
+
+    while (*list != '\0') {
+        char *end;
+        long pid = strtol(list, &end, 10);
+        if (end == list || (*end != ',' && *end != '\0') || pid < 0) {
+            printf("Invalid PID list: %s\n", list);
+            display_usage();
+            exit(EXIT_FAILURE);
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            pid_t *grown = realloc(*pids, capacity * sizeof(pid_t));
+            if (grown == NULL) {
+                perror("Error allocating PID list");
+                exit(EXIT_FAILURE);
+            }
+            *pids = grown;
+        }
+        (*pids)[count++] = (pid_t)pid;
+        list = *end == ',' ? end + 1 : end;
+    }
+    *order = malloc((count + 1) * sizeof(pid_t));
+    if (*order == NULL) {
+        perror("Error allocating PID list");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(*order, *pids, count * sizeof(pid_t));
+    qsort(*pids, count, sizeof(pid_t), compare_pid);
+    return count;
+}
+
+// Sort pids by descending fd count, read as the st_size of
+// /proc/<pid>/fd: one fstatat each, far cheaper than any walk. Kernels
+// before 6.2 report 0 for every process, which leaves PID order.
+void order_by_fd_count(int proc_fd, pid_t *pids, size_t npids, scan_stats *stats) {
+    proc_count *counts = malloc((npids + 1) * sizeof(proc_count));
+    if (counts == NULL) {
+        perror("Error allocating PID list");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < npids; i++) {
+        char name[32];
+        struct stat st;
+        snprintf(name, sizeof(name), "%d/fd", pids[i]);
+        stats->calls[SC_FSTATAT]++;
+        counts[i].pid = pids[i];
+        counts[i].fds = 0;
+        if (fstatat(proc_fd, name, &st, 0) == 0) {
+            counts[i].fds = (unsigned long)st.st_size;
+        }
+        else {
+            note_failure(stats, SC_FSTATAT);
+        }
+    }
+    qsort(counts, npids, sizeof(proc_count), compare_proc_heavier);
+    for (size_t i = 0; i < npids; i++) {
+        pids[i] = counts[i].pid;
+    }
+    free(counts);
+}
+
+int compare_proc_heavier(const void *a, const void *b) {
+    if (proc_heavier(a, b)) return -1;
+    return proc_heavier(b, a) ? 1 : 0;
+}
+
+// Workers of a parallel scan start at the heads of equal slices of the
+// list. Deal the priority order out round-robin, so that slice w holds
+// ranks w, w + jobs, ... and together they still go most important first.
+void interleave_pids(pid_t *pids, size_t npids, int jobs) {
+    if ((size_t)jobs > npids) {
+        jobs = (int)npids;
+    }
+    pid_t *dealt = malloc((npids + 1) * sizeof(pid_t));
+    size_t *fill = malloc(jobs * sizeof(size_t));
+    if (dealt == NULL || fill == NULL) {
+        perror("Error allocating PID list");
+        exit(EXIT_FAILURE);
+    }
+    // Slice w is [npids * w / jobs, npids * (w + 1) / jobs), as in collect_parallel
+    for (int w = 0; w < jobs; w++) {
+        fill[w] = npids * w / jobs;
+    }
+    int w = 0;
+    for (size_t r = 0; r < npids; r++) {
+        while (fill[w] == npids * (w + 1) / jobs) {
+            w = (w + 1) % jobs;
+        }
+        dealt[fill[w]++] = pids[r];
+        w = (w + 1) % jobs;
+    }
+    memcpy(pids, dealt, npids * sizeof(pid_t));
+    free(dealt);
+    free(fill);
+}
+
+// Returns -1 with errno set when the array cannot grow
+int pid_array_push(pid_array *array, pid_t pid) {
+    if (array->count == array->capacity) {
+        size_t new_capacity = array->capacity ? array->capacity * 2 : 64;
+        pid_t *grown = realloc(array->pids, new_capacity * sizeof(pid_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        array->pids = grown;
+        array->capacity = new_capacity;
+    }
+    array->pids[array->count++] = pid;
+    return 0;
+}
+
+// Stat the descriptor through its fd link and fill in rec's inode fields.
+// Returns -1 with errno set on failure.
+int resolve_inode(fd_snapshot *snap, int fd_dirfd, const char *name, fd_record *rec, const scan_options *opts) {
+    struct stat statbuf;
+    double started = opts->timed ? now_seconds() : 0;
+    snap->stats.calls[SC_FSTATAT]++;
+    int rc = fstatat(fd_dirfd, name, &statbuf, 0);
+    if (opts->timed) {
+        note_latency(&snap->stats, SC_FSTATAT, now_seconds() - started);
+    }
+    if (rc == -1) {
+        note_failure(&snap->stats, SC_FSTATAT);
+        return -1;
+    }
+    rec->inode = statbuf.st_ino;
+    rec->dev = statbuf.st_dev;
+    rec->mode = statbuf.st_mode;
+    rec->has_inode = 1;
+    return 0;
+}
+
+// Read the descriptor's link target into the snapshot's arena. Returns 1
+// when the type/path filters reject it (nothing is stored), 2 with errno
+// set when the link can't be read, -1 with errno set when memory runs out,
+// 0 otherwise.
+int resolve_target(fd_snapshot *snap, int fd_dirfd, const char *name, fd_record *rec, char **link,
+                   size_t *link_size, const scan_options *opts, double fd_started) {
+    double link_started = opts->timed ? now_seconds() : 0;
+    ssize_t len = read_link(fd_dirfd, name, link, link_size, &snap->stats);
+    if (opts->timed) {
+        double done = now_seconds();
+        note_latency(&snap->stats, SC_READLINKAT, done - link_started);
+        if (len != -1) {
+            note_slow_target(&snap->stats, rec->pid, rec->fd, *link, done - fd_started);
+        }
+    }
+    if (len == -1) {
+        int saved = errno;
+        if (saved == ENOMEM) return -1;
+        note_failure(&snap->stats, SC_READLINKAT);
+        if (saved != EACCES && saved != EPERM && saved != ENOENT) {
+            perror("Error reading link\n");
+        }
+        errno = saved;
+        return 2;
+    }
+    if (!target_selected(*link, opts)) return 1;
+
+    const char *target = arena_intern(&snap->strings, *link);
+    if (target == NULL) return -1;
+    rec->target = target;
+    rec->has_target = 1;
+    return 0;
+}
+
+// Set up an io_uring for batched statx. Returns NULL when the kernel has no
+// io_uring (or it is disabled, or can't be mapped), in which case callers
+// stat synchronously.
+stat_ring *stat_ring_open(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, STAT_RING_ENTRIES, &params);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    stat_ring *ring = calloc(1, sizeof(stat_ring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+        ring->cq_len = 0;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = ring->cq_len == 0 ? ring->sq_ptr
+                 : mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_len != 0 && ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_len);
+        if (ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+void stat_ring_close(stat_ring *ring) {
+    if (ring == NULL) return;
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_len != 0) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+    free(ring);
+}
+
+// Stat the fd links of records[pending[0..n)] through the ring, up to
+// STAT_RING_ENTRIES at a time with one io_uring_enter per round, and fill
+// in their inode fields. errs[i] gets 0 or the failing errno. Falls back to
+// fstatat for the rest of the run if the kernel rejects IORING_OP_STATX.
+void resolve_pending(fd_snapshot *snap, stat_ring *ring, int fd_dirfd, const size_t *pending, size_t n,
+                     int *errs, const scan_options *opts) {
+    for (size_t done = 0; done < n; ) {
+        size_t batch = n - done;
+        if (batch > STAT_RING_ENTRIES) batch = STAT_RING_ENTRIES;
+
+        if (ring->broken) {
+            for (size_t i = done; i < n; i++) {
+                fd_record *rec = &snap->records[pending[i]];
+                char name[16];
+                snprintf(name, sizeof(name), "%d", rec->fd);
+                errs[i] = resolve_inode(snap, fd_dirfd, name, rec, opts) == -1 ? errno : 0;
+            }
+            return;
+        }
+
+        unsigned tail = *ring->sq_tail;
+        for (size_t i = 0; i < batch; i++) {
+            const fd_record *rec = &snap->records[pending[done + i]];
+            unsigned slot = (tail + (unsigned)i) & ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[slot];
+            snprintf(ring->names[i], sizeof(ring->names[i]), "%d", rec->fd);
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = fd_dirfd;
+            sqe->addr = (uint64_t)(uintptr_t)ring->names[i];
+            sqe->len = STATX_TYPE | STATX_MODE | STATX_INO;
+            sqe->off = (uint64_t)(uintptr_t)&ring->bufs[i];
+            sqe->user_data = i;
+            ring->sq_array[slot] = slot;
+        }
+        __atomic_store_n(ring->sq_tail, tail + (unsigned)batch, __ATOMIC_RELEASE);
+
+        size_t reaped = 0;
+        while (reaped < batch) {
+            unsigned to_submit = reaped == 0 ? (unsigned)batch : 0;
+            snap->stats.calls[SC_URING_ENTER]++;
+            if (syscall(__NR_io_uring_enter, ring->fd, to_submit, (unsigned)(batch - reaped),
+                        IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+                if (errno == EINTR) continue;
+                perror("Error waiting for stat ring");
+                exit(EXIT_FAILURE);
+            }
+            unsigned head = *ring->cq_head;
+            unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != cq_tail; head++) {
+                const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+                size_t i = (size_t)cqe->user_data;
+                fd_record *rec = &snap->records[pending[done + i]];
+                snap->stats.calls[SC_STATX]++;
+                if (cqe->res < 0) {
+                    errs[done + i] = -cqe->res;
+                    errno = -cqe->res;
+                    note_failure(&snap->stats, SC_STATX);
+                }
+                else {
+                    const struct statx *stx = &ring->bufs[i];
+                    rec->inode = stx->stx_ino;
+                    rec->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+                    rec->mode = stx->stx_mode;
+                    rec->has_inode = 1;
+                    errs[done + i] = 0;
+                }
+                reaped++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        // Kernels before 5.6 know io_uring but not statx on it
+        if (batch > 0 && errs[done] == EINVAL && !snap->records[pending[done]].has_inode) {
+            ring->broken = 1;
+            continue;
+        }
+        done += batch;
+    }
+}
+
+// Returns -1 with errno set when the array cannot grow
+int append_proc_count(fd_snapshot *snap, pid_t pid, unsigned long fds) {
+    if (snap->nprocs == snap->procs_capacity) {
+        size_t new_capacity = snap->procs_capacity ? snap->procs_capacity * 2 : 4;
+        proc_count *grown = realloc(snap->procs, new_capacity * sizeof(proc_count));
+        if (grown == NULL) {
+            return -1;
+        }
+        snap->procs = grown;
+        snap->procs_capacity = new_capacity;
+    }
+    snap->procs[snap->nprocs].pid = pid;
+    snap->procs[snap->nprocs].fds = fds;
+    snap->nprocs++;
+    return 0;
+}
+
+// Since Linux 6.2 stat() on /proc/<pid>/fd reports the number of open fds
+// as st_size. We hold at least stdin/stdout/stderr, so a zero size for our
+// own fd directory means the kernel is older and sizes are meaningless.
+int kernel_reports_fd_counts(int proc_fd) {
+    struct stat st;
+    return fstatat(proc_fd, "self/fd", &st, 0) == 0 && st.st_size > 0;
+}
+
+// Reserve a zeroed record at the end of the snapshot
+fd_record *append_record(fd_snapshot *snap) {
+    // Grow the record array geometrically so appends stay amortized O(1)
+    if (snap->count == snap->capacity) {
+        size_t new_capacity = snap->capacity ? snap->capacity * 2 : 16;
+        fd_record *grown = realloc(snap->records, new_capacity * sizeof(fd_record));
+        if (grown == NULL) {
+            return NULL;
+        }
+        snap->records = grown;
+        snap->capacity = new_capacity;
+    }
+
+    fd_record *rec = &snap->records[snap->count++];
+    rec->pid = 0;
+    rec->fd = 0;
+    rec->has_target = 0;
+    rec->has_inode = 0;
+    rec->inode = 0;
+    rec->dev = 0;
+    rec->mode = 0;
+    rec->target = "";
+    rec->has_fdinfo = 0;
+    rec->extra = "";
+    return rec;
+}
+
+// append_record for the command line, where running out of memory ends it
+fd_record *append_record_or_exit(fd_snapshot *snap) {
+    fd_record *rec = append_record(snap);
+    if (rec == NULL) {
+        perror("Error allocating snapshot");
+        exit(EXIT_FAILURE);
+    }
+    return rec;
+}
+
+// Scan the PID list with a pool of workers. Each worker starts with an equal
+// slice of the list and steals from the busiest slices once its own runs dry,
+// so a few processes holding 100k fds don't leave the other cores idle.
+// Each worker gathers into a snapshot of its own and notes where every PID's
+// rows went; the rows are then concatenated in list order, which makes the
+// output identical to a serial run. Memory follows the rows, plus a few
+// words per PID. Returns -1 with errno set when memory runs out or no
+// worker could be started.
+int collect_parallel(fd_snapshot *snap, int proc_fd, const pid_t *pids, size_t npids, const scan_options *opts) {
+    int jobs = opts->jobs;
+    if ((size_t)jobs > npids) {
+        jobs = (int)npids;
+    }
+
+    scan_pool pool;
+    pool.opts = opts;
+    pool.proc_fd = proc_fd;
+    pool.pids = pids;
+    pool.jobs = jobs;
+    pool.partials = calloc(jobs, sizeof(fd_snapshot));
+    pool.slots = malloc(npids * sizeof(scan_slot));
+    pool.queues = calloc(jobs, sizeof(scan_queue));
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    scan_worker *workers = calloc(jobs, sizeof(scan_worker));
+    char *running = calloc(jobs, 1);
+    int rc = 0, err = 0;
+    if (pool.partials == NULL || pool.slots == NULL || pool.queues == NULL || threads == NULL || workers == NULL
+        || running == NULL) {
+        free(pool.partials);
+        free(pool.slots);
+        free(pool.queues);
+        free(threads);
+        free(workers);
+        free(running);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int w = 0; w < jobs; w++) {
+        pthread_mutex_init(&pool.queues[w].lock, NULL);
+        pool.queues[w].head = npids * w / jobs;
+        pool.queues[w].tail = npids * (w + 1) / jobs;
+        workers[w].pool = &pool;
+        workers[w].id = w;
+    }
+    // A worker that can't be started leaves its slice to be stolen by the
+    // others; only with none running does the scan fail
+    int started = 0;
+    for (int w = 0; w < jobs; w++) {
+        int create_err = pthread_create(&threads[w], NULL, scan_worker_main, &workers[w]);
+        if (create_err != 0) {
+            err = create_err;
+            continue;
+        }
+        running[w] = 1;
+        started++;
+    }
+    // Thieves lock every queue, so none goes before all workers are done
+    for (int w = 0; w < jobs; w++) {
+        if (running[w]) {
+            pthread_join(threads[w], NULL);
+        }
+    }
+    for (int w = 0; w < jobs; w++) {
+        pthread_mutex_destroy(&pool.queues[w].lock);
+        if (workers[w].error != 0) {
+            err = workers[w].error;
+            rc = -1;
+        }
+    }
+    if (started == 0) {
+        rc = -1;
+    }
+
+    // Deterministic merge: one allocation, PID slots copied in list order
+    if (rc == 0 && merge_partials(snap, &pool, npids) == -1) {
+        err = errno;
+        rc = -1;
+    }
+
+    for (int w = 0; w < jobs; w++) {
+        free_snapshot(&pool.partials[w]);
+    }
+    free(pool.partials);
+    free(pool.slots);
+    free(pool.queues);
+    free(threads);
+    free(workers);
+    free(running);
+    errno = err;
+    return rc;
+}
+
+// The workers' rows, in PID list order, into snap. Returns -1 with errno
+// set when memory runs out.
+int merge_partials(fd_snapshot *snap, const scan_pool *pool, size_t npids) {
+    size_t total = 0;
+    for (int w = 0; w < pool->jobs; w++) {
+        total += pool->partials[w].count;
+        merge_stats(&snap->stats, &pool->partials[w].stats);
+    }
+    for (size_t i = 0; i < npids; i++) {
+        const scan_slot *slot = &pool->slots[i];
+        const fd_snapshot *part = &pool->partials[slot->worker];
+        if ((slot->proc != SIZE_MAX
+             && append_proc_count(snap, part->procs[slot->proc].pid, part->procs[slot->proc].fds) == -1)
+            || (slot->covered != SIZE_MAX && pid_array_push(&snap->covered, part->covered.pids[slot->covered]) == -1)
+            || (slot->partial != SIZE_MAX && pid_array_push(&snap->partial, part->partial.pids[slot->partial]) == -1)
+            || (slot->skipped != SIZE_MAX && pid_array_push(&snap->skipped, part->skipped.pids[slot->skipped]) == -1)) {
+            return -1;
+        }
+    }
+    if (total > snap->capacity) {
+        fd_record *records = malloc(total * sizeof(fd_record));
+        if (records == NULL) {
+            return -1;
+        }
+        free(snap->records);
+        snap->records = records;
+        snap->capacity = total;
+    }
+    for (size_t i = 0; i < npids; i++) {
+        // Targets move into the snapshot's arena, deduplicated across workers
+        const scan_slot *slot = &pool->slots[i];
+        const fd_snapshot *part = &pool->partials[slot->worker];
+        for (size_t r = slot->first; r < slot->first + slot->count; r++) {
+            fd_record *rec = &snap->records[snap->count];
+            *rec = part->records[r];
+            if (rec->has_target && (rec->target = arena_intern(&snap->strings, rec->target)) == NULL) {
+                return -1;
+            }
+            if (rec->has_fdinfo && (rec->extra = arena_intern(&snap->strings, rec->extra)) == NULL) {
+                return -1;
+            }
+            snap->count++;
+        }
+    }
+    return 0;
+}
+
+void *scan_worker_main(void *arg) {
+    scan_worker *self = arg;
+    scan_pool *pool = self->pool;
+    scan_queue *own = &pool->queues[self->id];
+    fd_snapshot *mine = &pool->partials[self->id];
+    stat_ring *ring = pool->opts->use_ring && pool->opts->need_inode ? stat_ring_open() : NULL;
+    table_index tables;
+    memset(&tables, 0, sizeof(tables));
+    tables.disabled = pool->opts->count_only || strcmp(pool->opts->proc_root, "/proc") != 0;
+
+    for (;;) {
+        pthread_mutex_lock(&own->lock);
+        if (own->head == own->tail) {
+            pthread_mutex_unlock(&own->lock);
+            if (!steal_work(pool, self->id)) {
+                break;
+            }
+            continue;
+        }
+        size_t index = own->head++;
+        pthread_mutex_unlock(&own->lock);
+
+        scan_slot *slot = &pool->slots[index];
+        slot->worker = self->id;
+        slot->first = mine->count;
+        size_t nprocs = mine->nprocs, ncovered = mine->covered.count, npartial = mine->partial.count;
+        size_t nskipped = mine->skipped.count;
+        if (collect_pid_shared(mine, pool->proc_fd, pool->pids[index], pool->opts, ring, &tables) == -1) {
+            // The scan is failing: collect_parallel discards every slot
+            self->error = errno;
+            break;
+        }
+        slot->count = mine->count - slot->first;
+        slot->proc = mine->nprocs > nprocs ? nprocs : SIZE_MAX;
+        slot->covered = mine->covered.count > ncovered ? ncovered : SIZE_MAX;
+        slot->partial = mine->partial.count > npartial ? npartial : SIZE_MAX;
+        slot->skipped = mine->skipped.count > nskipped ? nskipped : SIZE_MAX;
+    }
+    stat_ring_close(ring);
+    free(tables.tables);
+    return NULL;
+}
+
+// Move the back half of the fullest other queue into the thief's queue.
+// Returns 0 when there is nothing left anywhere.
+int steal_work(scan_pool *pool, int thief) {
+    for (;;) {
+        int victim = -1;
+        size_t most = 0;
+
+        // Pick the victim with the most remaining PIDs, locking each queue
+        // just to read its size
+        for (int w = 0; w < pool->jobs; w++) {
+            if (w == thief) continue;
+            pthread_mutex_lock(&pool->queues[w].lock);
+            size_t left = pool->queues[w].tail - pool->queues[w].head;
+            pthread_mutex_unlock(&pool->queues[w].lock);
+            if (left > most) {
+                most = left;
+                victim = w;
+            }
+        }
+        if (victim == -1) {
+            return 0;
+        }
+
+        scan_queue *from = &pool->queues[victim];
+        scan_queue *to = &pool->queues[thief];
+
+        pthread_mutex_lock(&from->lock);
+        size_t left = from->tail - from->head;
+        if (left == 0) {
+            // Raced with the owner; look again
+            pthread_mutex_unlock(&from->lock);
+            continue;
+        }
+        size_t take = (left + 1) / 2;
+        size_t new_tail = from->tail;
+        from->tail -= take;
+        pthread_mutex_unlock(&from->lock);
+
+        pthread_mutex_lock(&to->lock);
+        to->head = new_tail - take;
+        to->tail = new_tail;
+        pthread_mutex_unlock(&to->lock);
+        return 1;
+    }
+}
+
+void merge_stats(scan_stats *into, const scan_stats *from) {
+    for (int i = 0; i < SC_KINDS; i++) {
+        into->calls[i] += from->calls[i];
+        for (int f = 0; f < SF_KINDS; f++) {
+            into->failures[i][f] += from->failures[i][f];
+        }
+    }
+    into->processes += from->processes;
+    into->descriptors += from->descriptors;
+    into->filtered_pids += from->filtered_pids;
+    into->filtered_fds += from->filtered_fds;
+    into->shared_pids += from->shared_pids;
+    if (from->timing == NULL) {
+        return;
+    }
+    scan_timing *timing = stats_timing(into);
+    for (int i = 0; i < SC_KINDS; i++) {
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            timing->latency[i][b] += from->timing->latency[i][b];
+        }
+    }
+    for (size_t i = 0; i < from->timing->nslow_pids; i++) {
+        const slow_pid *p = &from->timing->slow_pids[i];
+        note_slow_pid(into, p->pid, p->fds, p->seconds);
+    }
+    for (size_t i = 0; i < from->timing->nslow_targets; i++) {
+        const slow_target *t = &from->timing->slow_targets[i];
+        note_slow_target(into, t->pid, t->fd, t->target, t->seconds);
+    }
+}
+
+static const char *stats_call_names[SC_KINDS] = {"openat", "getdents64", "readlinkat", "fstatat", "close", "read",
+                                                  "statx (ring)", "io_uring_enter", "kcmp"};
+static const char *stats_failure_names[SF_KINDS] = {"denied", "gone", "other"};
+static const char *stats_phase_names[PH_KINDS] = {"list", "walk", "sockets", "output", "save"};
+static const scan_timing no_timing;
+
+void print_scan_stats(const scan_stats *stats, int format) {
+    unsigned long total = 0;
+
+    if (format == STATS_JSON) {
+        print_scan_stats_json(stats);
+        return;
+    }
+
+    fprintf(stderr, "\nScan statistics:\n");
+    fprintf(stderr, "  processes scanned:\t%lu\n", stats->processes);
+    fprintf(stderr, "  descriptors:\t\t%lu\n", stats->descriptors);
+    if (stats->filtered_pids || stats->filtered_fds) {
+        fprintf(stderr, "  PIDs filtered out:\t%lu\n", stats->filtered_pids);
+        fprintf(stderr, "  fds filtered out:\t%lu\n", stats->filtered_fds);
+    }
+    if (stats->shared_pids) {
+        fprintf(stderr, "  shared fd tables:\t%lu\n", stats->shared_pids);
+    }
+    for (int i = 0; i < SC_KINDS; i++) {
+        const unsigned long *fail = stats->failures[i];
+        fprintf(stderr, "  %s calls:\t%lu", stats_call_names[i], stats->calls[i]);
+        if (fail[SF_DENIED] || fail[SF_GONE] || fail[SF_OTHER]) {
+            fprintf(stderr, "\t(failed: %lu EACCES, %lu ENOENT, %lu other)",
+                    fail[SF_DENIED], fail[SF_GONE], fail[SF_OTHER]);
+        }
+        fprintf(stderr, "\n");
+        total += stats->calls[i];
+    }
+    fprintf(stderr, "  total syscalls:\t%lu\n", total);
+    if (stats->descriptors > 0) {
+        fprintf(stderr, "  syscalls per fd:\t%.2f\n", (double)total / stats->descriptors);
+    }
+    fprintf(stderr, "  scan time (s):\t%.4f\n", stats->scan_seconds);
+    if (stats->scan_seconds > 0) {
+        fprintf(stderr, "  descriptors/sec:\t%.0f\n", stats->descriptors / stats->scan_seconds);
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(stderr, "  peak RSS (KiB):\t%ld\n", usage.ru_maxrss);
+    }
+
+    fprintf(stderr, "\nPhase times (s):\twall\tcpu\n");
+    for (int p = 0; p < PH_KINDS; p++) {
+        fprintf(stderr, "  %s\t\t%.4f\t%.4f\n", stats_phase_names[p], stats->phase_wall[p], stats->phase_cpu[p]);
+    }
+
+    const scan_timing *timing = stats->timing != NULL ? stats->timing : &no_timing;
+    for (int i = 0; i < SC_KINDS; i++) {
+        unsigned long samples = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            samples += timing->latency[i][b];
+        }
+        if (samples == 0) continue;
+
+        fprintf(stderr, "\n%s latency:\n", stats_call_names[i]);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (timing->latency[i][b] == 0) continue;
+            if (b == LATENCY_BUCKETS - 1) {
+                fprintf(stderr, "  >= %lu us\t%lu\n", 1UL << (b - 1), timing->latency[i][b]);
+            }
+            else {
+                fprintf(stderr, "  <  %lu us\t%lu\n", 1UL << b, timing->latency[i][b]);
+            }
+        }
+    }
+
+    if (timing->nslow_pids > 0) {
+        fprintf(stderr, "\nSlowest processes:\tfds\tms\n");
+        for (size_t i = 0; i < timing->nslow_pids; i++) {
+            const slow_pid *p = &timing->slow_pids[i];
+            fprintf(stderr, "  %d\t\t\t%lu\t%.3f\n", p->pid, p->fds, p->seconds * 1e3);
+        }
+    }
+    if (timing->nslow_targets > 0) {
+        fprintf(stderr, "\nSlowest targets:\tms\n");
+        for (size_t i = 0; i < timing->nslow_targets; i++) {
+            const slow_target *t = &timing->slow_targets[i];
+            fprintf(stderr, "  %d/%d\t\t%.3f\t%s\n", t->pid, t->fd, t->seconds * 1e3, t->target);
+        }
+    }
+}
+
+// The same numbers as one JSON object on a single line of stderr
+void print_scan_stats_json(const scan_stats *stats) {
+    struct rusage usage;
+    long peak_rss = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+    const scan_timing *timing = stats->timing != NULL ? stats->timing : &no_timing;
+
+    fprintf(stderr, "{\"processes\":%lu,\"descriptors\":%lu,\"filtered_pids\":%lu,\"filtered_fds\":%lu,"
+            "\"shared_pids\":%lu,\"scan_seconds\":%.6f,\"peak_rss_kib\":%ld",
+            stats->processes, stats->descriptors, stats->filtered_pids, stats->filtered_fds, stats->shared_pids,
+            stats->scan_seconds, peak_rss);
+
+    fprintf(stderr, ",\"calls\":{");
+    for (int i = 0; i < SC_KINDS; i++) {
+        fprintf(stderr, "%s\"%s\":{\"count\":%lu", i ? "," : "", stats_call_names[i], stats->calls[i]);
+        for (int f = 0; f < SF_KINDS; f++) {
+            fprintf(stderr, ",\"%s\":%lu", stats_failure_names[f], stats->failures[i][f]);
+        }
+        fprintf(stderr, ",\"latency_us\":[");
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            fprintf(stderr, "%s%lu", b ? "," : "", timing->latency[i][b]);
+        }
+        fprintf(stderr, "]}");
+    }
+
+    fprintf(stderr, "},\"phases\":{");
+    for (int p = 0; p < PH_KINDS; p++) {
+        fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", p ? "," : "",
+                stats_phase_names[p], stats->phase_wall[p], stats->phase_cpu[p]);
+    }
+
+    fprintf(stderr, "},\"slowest_pids\":[");
+    for (size_t i = 0; i < timing->nslow_pids; i++) {
+        const slow_pid *p = &timing->slow_pids[i];
+        fprintf(stderr, "%s{\"pid\":%d,\"fds\":%lu,\"seconds\":%.6f}", i ? "," : "", p->pid, p->fds, p->seconds);
+    }
+
+    fprintf(stderr, "],\"slowest_targets\":[");
+    for (size_t i = 0; i < timing->nslow_targets; i++) {
+        const slow_target *t = &timing->slow_targets[i];
+        fprintf(stderr, "%s{\"pid\":%d,\"fd\":%d,\"seconds\":%.6f,\"target\":", i ? "," : "", t->pid, t->fd, t->seconds);
+        print_json_string(stderr, t->target);
+        fprintf(stderr, "}");
+    }
+    fprintf(stderr, "]}\n");
+}
+
+// Link targets are arbitrary bytes apart from NUL; escape what JSON requires
+void print_json_string(FILE *file, const char *str) {
+    fputc('"', file);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', file);
+            fputc(*p, file);
+        }
+        else if (*p < 0x20) {
+            fprintf(file, "\\u%04x", *p);
+        }
+        else {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void phase_start(phase_mark *mark) {
+    mark->wall = now_seconds();
+    mark->cpu = cpu_seconds();
+}
+
+// Add the time since mark to a phase; a phase may run more than once
+void phase_stop(scan_stats *stats, int phase, const phase_mark *mark) {
+    stats->phase_wall[phase] += now_seconds() - mark->wall;
+    stats->phase_cpu[phase] += cpu_seconds() - mark->cpu;
+}
+
+// Classify errno for a call that just failed
+void note_failure(scan_stats *stats, int call) {
+    if (errno == EACCES || errno == EPERM) {
+        stats->failures[call][SF_DENIED]++;
+    }
+    else if (errno == ENOENT || errno == ESRCH) {
+        stats->failures[call][SF_GONE]++;
+    }
+    else {
+        stats->failures[call][SF_OTHER]++;
+    }
+}
+
+void note_latency(scan_stats *stats, int call, double seconds) {
+    double us = seconds * 1e6;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (double)(1UL << bucket)) {
+        bucket++;
+    }
+    stats_timing(stats)->latency[call][bucket]++;
+}
+
+scan_timing *stats_timing(scan_stats *stats) {
+    if (stats->timing == NULL) {
+        stats->timing = calloc(1, sizeof(scan_timing));
+        if (stats->timing == NULL) {
+            perror("Error allocating scan stats");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return stats->timing;
+}
+
+// Keep the STATS_SLOWEST slowest processes, slowest first
+void note_slow_pid(scan_stats *stats, pid_t pid, unsigned long fds, double seconds) {
+    scan_timing *timing = stats_timing(stats);
+    size_t i = timing->nslow_pids;
+    if (i == STATS_SLOWEST) {
+        if (seconds <= timing->slow_pids[i - 1].seconds) return;
+        i--;
+    }
+    else {
+        timing->nslow_pids++;
+    }
+    for (; i > 0 && timing->slow_pids[i - 1].seconds < seconds; i--) {
+        timing->slow_pids[i] = timing->slow_pids[i - 1];
+    }
+    timing->slow_pids[i].pid = pid;
+    timing->slow_pids[i].fds = fds;
+    timing->slow_pids[i].seconds = seconds;
+}
+
+void note_slow_target(scan_stats *stats, pid_t pid, int fd, const char *target, double seconds) {
+    scan_timing *timing = stats_timing(stats);
+    size_t i = timing->nslow_targets;
+    if (i == STATS_SLOWEST) {
+        if (seconds <= timing->slow_targets[i - 1].seconds) return;
+        i--;
+    }
+    else {
+        timing->nslow_targets++;
+    }
+    for (; i > 0 && timing->slow_targets[i - 1].seconds < seconds; i--) {
+        timing->slow_targets[i] = timing->slow_targets[i - 1];
+    }
+    timing->slow_targets[i].pid = pid;
+    timing->slow_targets[i].fd = fd;
+    timing->slow_targets[i].seconds = seconds;
+    strncpy(timing->slow_targets[i].target, target, MAX_FILENAME_LEN - 1);
+    timing->slow_targets[i].target[MAX_FILENAME_LEN - 1] = '\0';
+}
+
+void free_snapshot(fd_snapshot *snap) {
+    free(snap->records);
+    free(snap->procs);
+    free(snap->stats.timing);
+    snap->stats.timing = NULL;
+    snap->records = NULL;
+    snap->count = 0;
+    snap->capacity = 0;
+    snap->procs = NULL;
+    snap->nprocs = 0;
+    snap->procs_capacity = 0;
+    free_socket_table(snap->sockets);
+    snap->sockets = NULL;
+    arena_free(&snap->strings);
+    free(snap->covered.pids);
+    free(snap->partial.pids);
+    free(snap->skipped.pids);
+    memset(&snap->covered, 0, sizeof(snap->covered));
+    memset(&snap->partial, 0, sizeof(snap->partial));
+    memset(&snap->skipped, 0, sizeof(snap->skipped));
+}
+
+// Empty the snapshot for another scan, keeping its allocations
+void reset_snapshot(fd_snapshot *snap) {
+    snap->count = 0;
+    snap->nprocs = 0;
+    free_socket_table(snap->sockets);
+    snap->sockets = NULL;
+    arena_reset(&snap->strings);
+    snap->covered.count = 0;
+    snap->partial.count = 0;
+    snap->skipped.count = 0;
+    snap->pid_error = 0;
+    snap->scanned = 0;
+    scan_timing *timing = snap->stats.timing;
+    memset(&snap->stats, 0, sizeof(snap->stats));
+    if (timing != NULL) {
+        memset(timing, 0, sizeof(*timing));
+        snap->stats.timing = timing;
+    }
+}
+
+// Return the arena's copy of str, storing it on first sight; NULL with
+// errno set when memory runs out, the arena left as it was
+const char *arena_intern(string_arena *arena, const char *str) {
+    // Keep the load factor under 1/2 by rehashing into twice the slots
+    if ((arena->used + 1) * 2 > arena->slot_count) {
+        size_t old_count = arena->slot_count;
+        const char **old_slots = arena->slots;
+        const char **slots = calloc(old_count ? old_count * 2 : 64, sizeof(const char *));
+        if (slots == NULL) {
+            return NULL;
+        }
+        arena->slot_count = old_count ? old_count * 2 : 64;
+        arena->slots = slots;
+        for (size_t i = 0; i < old_count; i++) {
+            if (old_slots[i] == NULL) continue;
+            size_t s = hash_string(old_slots[i]) & (arena->slot_count - 1);
+            while (arena->slots[s] != NULL) {
+                s = (s + 1) & (arena->slot_count - 1);
+            }
+            arena->slots[s] = old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    size_t mask = arena->slot_count - 1;
+    size_t slot = hash_string(str) & mask;
+    while (arena->slots[slot] != NULL) {
+        if (strcmp(arena->slots[slot], str) == 0) {
+            return arena->slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    arena->slots[slot] = copy;
+    arena->used++;
+    return copy;
+}
+
+// Bump-allocate len bytes. Blocks double from ARENA_MIN_BLOCK up to
+// ARENA_MAX_BLOCK; a string longer than that gets a block of its own.
+// Returns NULL with errno set when memory runs out.
+char *arena_alloc(string_arena *arena, size_t len) {
+    arena_block *block = arena->blocks;
+    if (block == NULL || block->size - block->used < len) {
+        size_t size = block == NULL ? ARENA_MIN_BLOCK : block->size * 2;
+        if (size > ARENA_MAX_BLOCK) size = ARENA_MAX_BLOCK;
+        if (size < len) size = len;
+        block = malloc(sizeof(arena_block) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = size;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    char *p = block->data + block->used;
+    block->used += len;
+    return p;
+}
+
+// Forget every string but keep the newest (largest) block for the next scan
+void arena_reset(string_arena *arena) {
+    if (arena->blocks != NULL) {
+        arena_block *block = arena->blocks->next;
+        while (block != NULL) {
+            arena_block *next = block->next;
+            free(block);
+            block = next;
+        }
+        arena->blocks->next = NULL;
+        arena->blocks->used = 0;
+    }
+    if (arena->slots != NULL) {
+        memset(arena->slots, 0, arena->slot_count * sizeof(const char *));
+    }
+    arena->used = 0;
+}
+
+void arena_free(string_arena *arena) {
+    arena_reset(arena);
+    free(arena->blocks);
+    free(arena->slots);
+    arena->blocks = NULL;
+    arena->slots = NULL;
+    arena->slot_count = 0;
+}
+
+// readlinkat(2) into *buf, growing it until the whole target fits, so
+// targets of any length come back intact. The result is NUL-terminated.
+// Returns its length, or -1 with errno set (ENOMEM when *buf can't grow).
+ssize_t read_link(int dirfd, const char *name, char **buf, size_t *size, scan_stats *stats) {
+    for (;;) {
+        if (*size == 0 || *buf == NULL) {
+            *buf = malloc(LINK_BUF_LEN);
+            if (*buf == NULL) {
+                *size = 0;
+                return -1;
+            }
+            *size = LINK_BUF_LEN;
+        }
+        ssize_t len = readlinkat(dirfd, name, *buf, *size);
+        stats->calls[SC_READLINKAT]++;
+        if (len == -1) return -1;
+        if ((size_t)len < *size) {
+            (*buf)[len] = '\0';
+            return len;
+        }
+        // Possibly truncated: retry with twice the room
+        char *grown = realloc(*buf, *size * 2);
+        if (grown == NULL) {
+            return -1;
+        }
+        *buf = grown;
+        *size *= 2;
+    }
+}
+
+// Start an output stream on fd. A threaded stream hands full buffers to its
+// own writer thread so formatting the next rows overlaps the write(2).
+void out_open(out_stream *out, int fd, int threaded) {
+    memset(out, 0, sizeof(*out));
+    out->fd = fd;
+    out->threaded = threaded;
+    for (int i = 0; i < OUT_QUEUE_LEN; i++) {
+        out->bufs[i] = malloc(OUT_BUF_LEN);
+        if (out->bufs[i] == NULL) {
+            perror("Error allocating output buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threaded) {
+        pthread_mutex_init(&out->lock, NULL);
+        pthread_cond_init(&out->ready, NULL);
+        pthread_cond_init(&out->drained, NULL);
+        if (pthread_create(&out->thread, NULL, out_writer_main, out) != 0) {
+            perror("Error starting output writer");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Flush what is buffered and stop the writer thread. Returns -1 if any
+// write failed.
+int out_close(out_stream *out) {
+    out_flush(out);
+    if (out->threaded) {
+        pthread_mutex_lock(&out->lock);
+        out->closing = 1;
+        pthread_cond_signal(&out->ready);
+        pthread_mutex_unlock(&out->lock);
+        pthread_join(out->thread, NULL);
+        pthread_mutex_destroy(&out->lock);
+        pthread_cond_destroy(&out->ready);
+        pthread_cond_destroy(&out->drained);
+    }
+    for (int i = 0; i < OUT_QUEUE_LEN; i++) {
+        free(out->bufs[i]);
+    }
+    return out->error ? -1 : 0;
+}
+
+// Push everything written so far to the fd and wait until it got there,
+// so stdio output that follows stays in order
+void out_flush(out_stream *out) {
+    out_submit(out);
+    if (out->threaded) {
+        pthread_mutex_lock(&out->lock);
+        while (out->queued > 0) {
+            pthread_cond_wait(&out->drained, &out->lock);
+        }
+        pthread_mutex_unlock(&out->lock);
+    }
+}
+
+// Hand the buffer being filled to the writer and move on to a free one
+void out_submit(out_stream *out) {
+    if (out->len == 0) return;
+
+    if (!out->threaded) {
+        struct iovec iov;
+        iov.iov_base = out->bufs[out->fill];
+        iov.iov_len = out->len;
+        if (write_all(out->fd, &iov, 1) == -1) {
+            out->error = 1;
+        }
+        out->len = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    out->lens[out->fill] = out->len;
+    out->queued++;
+    pthread_cond_signal(&out->ready);
+    // The next buffer in the ring is free once the writer has let go of it
+    while (out->queued == OUT_QUEUE_LEN) {
+        pthread_cond_wait(&out->drained, &out->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
+    out->fill = (out->fill + 1) % OUT_QUEUE_LEN;
+    out->len = 0;
+}
+
+// Writer thread: drains every queued buffer with a single writev
+void *out_writer_main(void *arg) {
+    out_stream *out = arg;
+    struct iovec iov[OUT_QUEUE_LEN];
+
+    pthread_mutex_lock(&out->lock);
+    for (;;) {
+        while (out->queued == 0 && !out->closing) {
+            pthread_cond_wait(&out->ready, &out->lock);
+        }
+        if (out->queued == 0) break;
+
+        int count = out->queued;
+        for (int i = 0; i < count; i++) {
+            int b = (out->head + i) % OUT_QUEUE_LEN;
+            iov[i].iov_base = out->bufs[b];
+            iov[i].iov_len = out->lens[b];
+        }
+        pthread_mutex_unlock(&out->lock);
+
+        int failed = !out->error && write_all(out->fd, iov, count) == -1;
+
+        pthread_mutex_lock(&out->lock);
+        if (failed) {
+            out->error = 1;
+        }
+        out->head = (out->head + count) % OUT_QUEUE_LEN;
+        out->queued -= count;
+        pthread_cond_broadcast(&out->drained);
+    }
+    pthread_mutex_unlock(&out->lock);
+    return NULL;
+}
+
+// writev until every byte is out, retrying short writes and EINTR
+int write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+void out_write(out_stream *out, const char *data, size_t len) {
+    while (len > 0) {
+        if (out->len == OUT_BUF_LEN) {
+            out_submit(out);
+        }
+        size_t room = OUT_BUF_LEN - out->len;
+        size_t chunk = len < room ? len : room;
+        memcpy(out->bufs[out->fill] + out->len, data, chunk);
+        out->len += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void out_str(out_stream *out, const char *str) {
+    out_write(out, str, strlen(str));
+}
+
+void out_char(out_stream *out, char c) {
+    if (out->len == OUT_BUF_LEN) {
+        out_submit(out);
+    }
+    out->bufs[out->fill][out->len++] = c;
+}
+
+// Decimal formatting without printf: digits are produced two at a time
+// from a lookup table, right to left into a small scratch buffer
+void out_uint(out_stream *out, unsigned long value) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[24];
+    char *p = digits + sizeof(digits);
+
+    while (value >= 100) {
+        unsigned long pair = (value % 100) * 2;
+        value /= 100;
+        *--p = pairs[pair + 1];
+        *--p = pairs[pair];
+    }
+    if (value >= 10) {
+        *--p = pairs[value * 2 + 1];
+        *--p = pairs[value * 2];
+    }
+    else {
+        *--p = (char)('0' + value);
+    }
+    out_write(out, p, digits + sizeof(digits) - p);
+}
+
+void out_int(out_stream *out, long value) {
+    if (value < 0) {
+        out_char(out, '-');
+        out_uint(out, 0UL - (unsigned long)value);
+    }
+    else {
+        out_uint(out, (unsigned long)value);
+    }
+}
+
+void display_process_fd_table(out_stream *out, const fd_snapshot *snap, pid_t pid) {
+    out_str(out, "PID\tFD\n");
+    out_str(out, TABLE_RULE);
+
+    for (size_t i = 0; i < snap->count; i++) {
+        const fd_record *rec = &snap->records[i];
+        if ((pid != -1 && rec->pid != pid) || !rec->has_target) continue;
+        out_int(out, rec->pid);
+        out_char(out, '\t');
+        out_int(out, rec->fd);
+        out_char(out, '\n');
+    }
+    out_str(out, TABLE_RULE);
+}
+
+void display_systemwide_fd_table(out_stream *out, const fd_snapshot *snap, pid_t pid) {
+    out_str(out, "PID\tFD\tFilename\n");
+    out_str(out, TABLE_RULE);
+
+    for (size_t i = 0; i < snap->count; i++) {
+        const fd_record *rec = &snap->records[i];
+        if ((pid != -1 && rec->pid != pid) || !rec->has_target) continue;
+        out_int(out, rec->pid);
+        out_char(out, '\t');
+        out_int(out, rec->fd);
+        out_char(out, '\t');
+        out_str(out, rec->target);
+        out_socket_annotation(out, snap->sockets, rec->target, OUT_TEXT);
+        out_char(out, '\n');
+    }
+    out_str(out, TABLE_RULE);
+}
+
+void display_vnodes_fd_table(out_stream *out, const fd_snapshot *snap, pid_t pid) {
+    out_str(out, "FD\tInode\n");
+    out_str(out, TABLE_RULE);
+
+    for (size_t i = 0; i < snap->count; i++) {
+        const fd_record *rec = &snap->records[i];
+        if ((pid != -1 && rec->pid != pid) || !rec->has_inode) continue;
+        out_int(out, rec->fd);
+        out_char(out, '\t');
+        out_uint(out, rec->inode);
+        out_char(out, '\n');
+    }
+    out_str(out, TABLE_RULE);
+}
+
+// Column header for composite rows in the stream's format. NDJSON rows are
+// self-describing and get none.
+void composite_header(out_stream *out, int with_sockets) {
+    static const char *titles[COL_KINDS] = {"PID", "FD", "Filename", "Inode", "Pos", "Flags", "MntID", "Extra"};
+    static const char *names[COL_KINDS] = {"pid", "fd", "filename", "inode", "pos", "flags", "mnt_id", "extra"};
+
+    if (out->columns != NULL) {
+        if (out->format == OUT_NDJSON) return;
+        char sep = out->format == OUT_CSV ? ',' : '\t';
+        for (int c = 0; c < out->ncolumns; c++) {
+            if (c > 0) out_char(out, sep);
+            out_str(out, out->format == OUT_TEXT ? titles[out->columns[c]] : names[out->columns[c]]);
+        }
+        if (with_sockets && out->format != OUT_TEXT) {
+            out_char(out, sep);
+            out_str(out, "socket");
+        }
+        out_char(out, '\n');
+        if (out->format == OUT_TEXT) out_str(out, TABLE_RULE);
+        return;
+    }
+
+    switch (out->format) {
+    case OUT_NDJSON:
+        break;
+    case OUT_CSV:
+        out_str(out, with_sockets ? "pid,fd,filename,inode,socket\n" : "pid,fd,filename,inode\n");
+        break;
+    case OUT_TSV:
+        out_str(out, with_sockets ? "pid\tfd\tfilename\tinode\tsocket\n" : "pid\tfd\tfilename\tinode\n");
+        break;
+    default:
+        out_str(out, "PID\tFD\tFilename\tInode\n");
+        out_str(out, TABLE_RULE);
+        break;
+    }
+}
+
+void composite_footer(out_stream *out) {
+    if (out->format == OUT_TEXT) {
+        out_str(out, TABLE_RULE);
+    }
+}
+
+void display_composed_table(out_stream *out, const fd_snapshot *snap, pid_t pid) {
+    composite_header(out, snap->sockets != NULL);
+    composite_rows(out, snap, pid);
+    composite_footer(out);
+}
+
+void composite_rows(out_stream *out, const fd_snapshot *snap, pid_t pid) {
+    for (size_t i = 0; i < snap->count; i++) {
+        const fd_record *rec = &snap->records[i];
+        if ((pid != -1 && rec->pid != pid) || !rec->has_target || !rec->has_inode) continue;
+        write_record_row(out, rec, snap->sockets);
+    }
+}
+
+// One row under composite_header: the --columns picked, or the fixed four
+void write_record_row(out_stream *out, const fd_record *rec, const socket_table *sockets) {
+    if (out->columns != NULL) {
+        // Scanned without fdinfo (no such column), or it vanished meanwhile
+        if (!rec->has_fdinfo) {
+            for (int c = 0; c < out->ncolumns; c++) {
+                if (out->columns[c] >= COL_POS) return;
+            }
+        }
+        write_column_row(out, rec, sockets);
+        return;
+    }
+    write_composite_row(out, rec->pid, rec->fd, rec->has_target ? rec->target : "", rec->inode, sockets);
+}
+
+// A composite row restricted to, and ordered by, the --columns selection.
+// The socket annotation follows the filename in text and is a trailing
+// field otherwise, as in write_composite_row.
+void write_column_row(out_stream *out, const fd_record *rec, const socket_table *sockets) {
+    static const char *keys[COL_KINDS] = {"\"pid\":", "\"fd\":", "\"filename\":", "\"inode\":",
+                                          "\"pos\":", "\"flags\":", "\"mnt_id\":", "\"extra\":"};
+    char sep = out->format == OUT_CSV ? ',' : '\t';
+
+    for (int c = 0; c < out->ncolumns; c++) {
+        int column = out->columns[c];
+        if (out->format == OUT_NDJSON) {
+            out_char(out, c > 0 ? ',' : '{');
+            out_str(out, keys[column]);
+        }
+        else if (c > 0) {
+            out_char(out, sep);
+        }
+        out_column_value(out, rec, column, sockets);
+    }
+    if (sockets != NULL && out->format != OUT_TEXT) {
+        if (out->format == OUT_NDJSON) {
+            out_str(out, ",\"socket\":\"");
+        }
+        else {
+            out_char(out, sep);
+            if (out->format == OUT_CSV) out_char(out, '"');
+        }
+        out_socket_annotation(out, sockets, rec->target, out->format);
+        if (out->format != OUT_TSV) out_char(out, '"');
+    }
+    out_str(out, out->format == OUT_NDJSON ? "}\n" : "\n");
+}
+
+// One field, quoted and escaped as the format needs; flags stay octal,
+// as the kernel prints them
+void out_column_value(out_stream *out, const fd_record *rec, int column, const socket_table *sockets) {
+    const char *text = NULL;
+    char octal[16];
+
+    switch (column) {
+    case COL_PID:
+        out_int(out, rec->pid);
+        return;
+    case COL_FD:
+        out_int(out, rec->fd);
+        return;
+    case COL_INODE:
+        out_uint(out, rec->inode);
+        return;
+    case COL_POS:
+        out_int(out, rec->pos);
+        return;
+    case COL_MNT_ID:
+        out_int(out, rec->mnt_id);
+        return;
+    case COL_FLAGS:
+        snprintf(octal, sizeof(octal), "0%o", rec->flags);
+        text = octal;
+        break;
+    case COL_FILENAME:
+        text = rec->target;
+        break;
+    default:
+        text = rec->extra;
+        break;
+    }
+
+    if (out->format == OUT_TEXT) {
+        out_str(out, text);
+        if (column == COL_FILENAME && sockets != NULL) {
+            out_socket_annotation(out, sockets, text, OUT_TEXT);
+        }
+        return;
+    }
+    if (out->format != OUT_TSV) out_char(out, '"');
+    out_escaped(out, text, out->format);
+    if (out->format != OUT_TSV) out_char(out, '"');
+}
+
+// scan_options.emit hook for a streamed composite table: write the rows of
+// the process just scanned, before its records are dropped
+void emit_composite_rows(const fd_snapshot *snap, void *arg) {
+    composite_rows(arg, snap, -1);
+}
+
+// One composite row. sockets, when given, adds the /proc/net annotation:
+// appended to the filename in text, as its own field otherwise.
+void write_composite_row(out_stream *out, pid_t pid, int fd, const char *target, unsigned long inode,
+                         const socket_table *sockets) {
+    switch (out->format) {
+    case OUT_NDJSON:
+        out_str(out, "{\"pid\":");
+        out_int(out, pid);
+        out_str(out, ",\"fd\":");
+        out_int(out, fd);
+        out_str(out, ",\"filename\":\"");
+        out_escaped(out, target, OUT_NDJSON);
+        out_str(out, "\",\"inode\":");
+        out_uint(out, inode);
+        if (sockets != NULL) {
+            out_str(out, ",\"socket\":\"");
+            out_socket_annotation(out, sockets, target, OUT_NDJSON);
+            out_char(out, '"');
+        }
+        out_str(out, "}\n");
+        break;
+    case OUT_CSV:
+        out_int(out, pid);
+        out_char(out, ',');
+        out_int(out, fd);
+        out_str(out, ",\"");
+        out_escaped(out, target, OUT_CSV);
+        out_str(out, "\",");
+        out_uint(out, inode);
+        if (sockets != NULL) {
+            out_str(out, ",\"");
+            out_socket_annotation(out, sockets, target, OUT_CSV);
+            out_char(out, '"');
+        }
+        out_char(out, '\n');
+        break;
+    case OUT_TSV:
+        out_int(out, pid);
+        out_char(out, '\t');
+        out_int(out, fd);
+        out_char(out, '\t');
+        out_escaped(out, target, OUT_TSV);
+        out_char(out, '\t');
+        out_uint(out, inode);
+        if (sockets != NULL) {
+            out_char(out, '\t');
+            out_socket_annotation(out, sockets, target, OUT_TSV);
+        }
+        out_char(out, '\n');
+        break;
+    default:
+        out_int(out, pid);
+        out_char(out, '\t');
+        out_int(out, fd);
+        out_char(out, '\t');
+        out_str(out, target);
+        if (sockets != NULL) {
+            out_socket_annotation(out, sockets, target, OUT_TEXT);
+        }
+        out_char(out, '\t');
+        out_uint(out, inode);
+        out_char(out, '\n');
+        break;
+    }
+}
+
+// Write str with whatever the format needs escaped: JSON string escapes,
+// doubled quotes inside a quoted CSV field, or backslash escapes for TSV
+// (tab, newline, carriage return, backslash). The quotes themselves are
+// the caller's. Safe runs are copied in one piece.
+void out_escaped(out_stream *out, const char *str, int format) {
+    const char *run = str;
+    const char *p = str;
+    char code[8];
+
+    for (; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        const char *esc = NULL;
+        if (format == OUT_NDJSON) {
+            if (c == '"') esc = "\\\"";
+            else if (c == '\\') esc = "\\\\";
+            else if (c == '\n') esc = "\\n";
+            else if (c == '\t') esc = "\\t";
+            else if (c < 0x20) {
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                esc = code;
+            }
+        }
+        else if (format == OUT_CSV) {
+            if (c == '"') esc = "\"\"";
+        }
+        else if (format == OUT_TSV) {
+            if (c == '\t') esc = "\\t";
+            else if (c == '\n') esc = "\\n";
+            else if (c == '\r') esc = "\\r";
+            else if (c == '\\') esc = "\\\\";
+        }
+        if (esc != NULL) {
+            out_write(out, run, (size_t)(p - run));
+            out_str(out, esc);
+            run = p + 1;
+        }
+    }
+    out_write(out, run, (size_t)(p - run));
+}
+
+// Report processes holding more than threshold descriptors
+void flag_offending_processes(out_stream *out, const fd_snapshot *snap, int threshold) {
+    out_str(out, "\nOffending processes (PID, FD count):\n");
+    out_str(out, TABLE_RULE);
+
+    for (size_t i = 0; i < snap->nprocs; i++) {
+        const proc_count *proc = &snap->procs[i];
+        if (proc->fds > (unsigned long)threshold) {
+            out_int(out, proc->pid);
+            out_char(out, '\t');
+            out_uint(out, proc->fds);
+            out_char(out, '\n');
+        }
+    }
+    out_str(out, TABLE_RULE);
+}
+
+// Print the k processes holding the most descriptors. A min-heap of size k
+// keeps the candidates, so the pass is O(n log k) with O(k) memory.
+void display_top_processes(out_stream *out, const fd_snapshot *snap, int k) {
+    proc_count *heap = malloc((size_t)k * sizeof(proc_count));
+    size_t size = 0;
+    if (heap == NULL) {
+        perror("Error allocating top-K heap");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < snap->nprocs; i++) {
+        const proc_count *proc = &snap->procs[i];
+        if (size < (size_t)k) {
+            heap[size++] = *proc;
+            sift_up(heap, size - 1);
+        }
+        else if (proc_heavier(proc, &heap[0])) {
+            heap[0] = *proc;
+            sift_down(heap, size, 0);
+        }
+    }
+
+    // Pop the lightest repeatedly to lay the heap out heaviest-first
+    for (size_t n = size; n > 1; n--) {
+        proc_count tmp = heap[0];
+        heap[0] = heap[n - 1];
+        heap[n - 1] = tmp;
+        sift_down(heap, n - 1, 0);
+    }
+
+    out_str(out, "\nTop processes by open FDs:\n");
+    out_str(out, "PID\tFDs\n");
+    out_str(out, TABLE_RULE);
+    for (size_t i = 0; i < size; i++) {
+        out_int(out, heap[i].pid);
+        out_char(out, '\t');
+        out_uint(out, heap[i].fds);
+        out_char(out, '\n');
+    }
+    out_str(out, TABLE_RULE);
+    free(heap);
+}
+
+// Order for the top-K heap: more fds first, lower PID wins ties
+int proc_heavier(const proc_count *a, const proc_count *b) {
+    if (a->fds != b->fds) return a->fds > b->fds;
+    return a->pid < b->pid;
+}
+
+void sift_up(proc_count *heap, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!proc_heavier(&heap[parent], &heap[i])) break;
+        proc_count tmp = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = tmp;
+        i = parent;
+    }
+}
+
+void sift_down(proc_count *heap, size_t size, size_t i) {
+    for (;;) {
+        size_t lightest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < size && proc_heavier(&heap[lightest], &heap[left])) lightest = left;
+        if (right < size && proc_heavier(&heap[lightest], &heap[right])) lightest = right;
+        if (lightest == i) break;
+        proc_count tmp = heap[lightest];
+        heap[lightest] = heap[i];
+        heap[i] = tmp;
+        i = lightest;
+    }
+}
+
+// Parse "uid,type" into SUM_* keys in the order given; returns the count
+int parse_summary_keys(const char *list, int *keys) {
+    static const char *names[SUM_KINDS] = {"pid", "uid", "mount", "type", "target"};
+    int count = 0;
+
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        int k;
+        for (k = 0; k < SUM_KINDS; k++) {
+            if (strlen(names[k]) == len && strncmp(list, names[k], len) == 0) break;
+        }
+        if (k == SUM_KINDS) {
+            printf("Unknown summary key: %.*s\n", (int)len, list);
+            display_usage();
+            exit(EXIT_FAILURE);
+        }
+        for (int j = 0; j < count; j++) {
+            if (keys[j] == k) {
+                printf("Duplicate summary key: %.*s\n", (int)len, list);
+                display_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+        keys[count++] = k;
+        list += len;
+        if (*list == ',') list++;
+    }
+    if (count == 0) {
+        printf("No summary keys given\n");
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
+
+void summary_init(summary_state *sum, const int *keys, int nkeys, const char *proc_root) {
+    memset(sum, 0, sizeof(*sum));
+    memcpy(sum->keys, keys, nkeys * sizeof(int));
+    sum->nkeys = nkeys;
+    sum->proc_fd = -1;
+    for (int k = 0; k < nkeys; k++) {
+        if (keys[k] != SUM_PID && keys[k] != SUM_UID) sum->per_fd = 1;
+        if (keys[k] == SUM_MOUNT) sum->need_inode = 1;
+        if (keys[k] == SUM_UID) {
+            sum->proc_fd = open(proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (sum->proc_fd == -1) {
+                perror("Error opening proc root");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    sum->slot_count = 1024;
+    sum->slots = calloc(sum->slot_count, sizeof(summary_group));
+    if (sum->slots == NULL) {
+        perror("Error allocating summary");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void summary_free(summary_state *sum) {
+    if (sum->proc_fd != -1) {
+        close(sum->proc_fd);
+    }
+    free(sum->slots);
+    free(sum->key);
+    arena_free(&sum->strings);
+}
+
+// scan_options.emit hook (and, after a parallel scan, called once on the
+// merged snapshot): count what the snapshot holds into the groups.
+// Per-process keys use the fd counts, the others every record.
+void summary_add(const fd_snapshot *snap, void *arg) {
+    summary_state *sum = arg;
+
+    if (!sum->per_fd) {
+        for (size_t i = 0; i < snap->nprocs; i++) {
+            summary_count(sum, snap->procs[i].pid, NULL, snap->procs[i].fds);
+        }
+        return;
+    }
+    for (size_t i = 0; i < snap->count; i++) {
+        summary_count(sum, snap->records[i].pid, &snap->records[i], 1);
+    }
+}
+
+// Add fds to the group of (pid, rec), creating it on first sight
+void summary_count(summary_state *sum, pid_t pid, const fd_record *rec, unsigned long fds) {
+    size_t len = 0;
+
+    for (int k = 0; k < sum->nkeys; k++) {
+        char field[64];
+        const char *text = field;
+        uid_t uid;
+
+        switch (sum->keys[k]) {
+        case SUM_PID:
+            snprintf(field, sizeof(field), "%d", pid);
+            break;
+        case SUM_UID:
+            if (summary_uid(sum, pid, &uid) == -1) return;  // exited meanwhile
+            snprintf(field, sizeof(field), "%u", (unsigned)uid);
+            break;
+        case SUM_MOUNT:
+            if (!rec->has_inode) return;
+            snprintf(field, sizeof(field), "%u:%u", major(rec->dev), minor(rec->dev));
+            break;
+        case SUM_TYPE: {
+            static const char *type_names[] = {"", "file", "socket", "", "pipe", "", "", "", "anon"};
+            if (!rec->has_target) return;
+            text = type_names[fd_type_of(rec->target)];
+            break;
+        }
+        default:
+            if (!rec->has_target) return;
+            text = rec->target;
+            break;
+        }
+
+        // Whole fields only: a cut target would merge distinct groups
+        size_t n = strlen(text);
+        if (len + n + 2 > sum->key_capacity) {
+            size_t capacity = (len + n + 2) * 2;
+            char *grown = realloc(sum->key, capacity);
+            if (grown == NULL) {
+                perror("Error allocating summary");
+                exit(EXIT_FAILURE);
+            }
+            sum->key = grown;
+            sum->key_capacity = capacity;
+        }
+        if (k > 0) sum->key[len++] = SUMMARY_SEP;
+        memcpy(sum->key + len, text, n);
+        len += n;
+    }
+    const char *key = sum->key;
+    sum->key[len] = '\0';
+
+    size_t mask = sum->slot_count - 1;
+    size_t s = hash_string(key) & mask;
+    while (sum->slots[s].key != NULL && strcmp(sum->slots[s].key, key) != 0) {
+        s = (s + 1) & mask;
+    }
+    summary_group *group = &sum->slots[s];
+    if (group->key == NULL) {
+        group->key = arena_intern(&sum->strings, key);
+        if (group->key == NULL) {
+            perror("Error allocating summary");
+            exit(EXIT_FAILURE);
+        }
+        group->last_pid = -1;
+        sum->used++;
+    }
+    group->fds += fds;
+    if (group->last_pid != pid) {
+        group->procs++;
+        group->last_pid = pid;
+    }
+
+    // Keep the table at most half full
+    if (sum->used * 2 > sum->slot_count) {
+        size_t old_count = sum->slot_count;
+        summary_group *old = sum->slots;
+        sum->slot_count *= 2;
+        sum->slots = calloc(sum->slot_count, sizeof(summary_group));
+        if (sum->slots == NULL) {
+            perror("Error allocating summary");
+            exit(EXIT_FAILURE);
+        }
+        mask = sum->slot_count - 1;
+        for (size_t i = 0; i < old_count; i++) {
+            if (old[i].key == NULL) continue;
+            size_t t = hash_string(old[i].key) & mask;
+            while (sum->slots[t].key != NULL) {
+                t = (t + 1) & mask;
+            }
+            sum->slots[t] = old[i];
+        }
+        free(old);
+    }
+}
+
+// Owner of /proc/<pid>, i.e. the process's effective UID. Records arrive
+// grouped by PID, so one lookup per process is enough.
+int summary_uid(summary_state *sum, pid_t pid, uid_t *uid) {
+    if (!sum->uid_known || sum->uid_pid != pid) {
+        char name[16];
+        struct stat st;
+        snprintf(name, sizeof(name), "%d", pid);
+        sum->uid_lookups++;
+        sum->uid_pid = pid;
+        sum->uid_known = -1;
+        if (fstatat(sum->proc_fd, name, &st, 0) == 0) {
+            sum->uid_known = 1;
+            sum->uid = st.st_uid;
+        }
+    }
+    *uid = sum->uid;
+    return sum->uid_known == 1 ? 0 : -1;
+}
+
+// Most descriptors first, then by key
+int compare_summary_group(const void *a, const void *b) {
+    const summary_group *ga = a;
+    const summary_group *gb = b;
+    if (ga->fds != gb->fds) return ga->fds < gb->fds ? 1 : -1;
+    return strcmp(ga->key, gb->key);
+}
+
+// Print the groups largest first, top of them when top > 0, as a table or
+// in the stream's --format
+void display_summary(out_stream *out, summary_state *sum, int top) {
+    static const char *titles[SUM_KINDS] = {"PID", "UID", "Mount", "Type", "Target"};
+    static const char *names[SUM_KINDS] = {"pid", "uid", "mount", "type", "target"};
+    char sep = out->format == OUT_CSV ? ',' : '\t';
+
+    // Gather the groups at the front of the slot array and sort them there
+    size_t n = 0;
+    for (size_t i = 0; i < sum->slot_count; i++) {
+        if (sum->slots[i].key != NULL) sum->slots[n++] = sum->slots[i];
+    }
+    qsort(sum->slots, n, sizeof(summary_group), compare_summary_group);
+    if (top > 0 && (size_t)top < n) n = top;
+
+    if (out->format != OUT_NDJSON) {
+        for (int k = 0; k < sum->nkeys; k++) {
+            out_str(out, out->format == OUT_TEXT ? titles[sum->keys[k]] : names[sum->keys[k]]);
+            out_char(out, sep);
+        }
+        out_str(out, out->format == OUT_TEXT ? "FDs\tProcesses\n" : (sep == ',' ? "fds,processes\n" : "fds\tprocesses\n"));
+        if (out->format == OUT_TEXT) out_str(out, TABLE_RULE);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const summary_group *group = &sum->slots[i];
+        const char *field = group->key;
+        if (out->format == OUT_NDJSON) out_char(out, '{');
+        for (int k = 0; k < sum->nkeys; k++) {
+            const char *end = strchr(field, SUMMARY_SEP);
+            size_t len = end != NULL ? (size_t)(end - field) : strlen(field);
+            // Every key was built in sum->key, so any one field fits there
+            char *value = sum->key;
+            memcpy(value, field, len);
+            value[len] = '\0';
+            int quoted = sum->keys[k] != SUM_PID && sum->keys[k] != SUM_UID;
+
+            if (out->format == OUT_NDJSON) {
+                out_char(out, '"');
+                out_str(out, names[sum->keys[k]]);
+                out_str(out, quoted ? "\":\"" : "\":");
+            }
+            if (out->format == OUT_CSV && quoted) out_char(out, '"');
+            if (out->format == OUT_TEXT) out_str(out, value);
+            else out_escaped(out, value, out->format);
+            if ((out->format == OUT_CSV || out->format == OUT_NDJSON) && quoted) out_char(out, '"');
+            out_char(out, out->format == OUT_NDJSON ? ',' : sep);
+            field += len + (end != NULL);
+        }
+        if (out->format == OUT_NDJSON) out_str(out, "\"fds\":");
+        out_uint(out, group->fds);
+        out_str(out, out->format == OUT_NDJSON ? ",\"processes\":" : (sep == ',' ? "," : "\t"));
+        out_uint(out, group->procs);
+        out_str(out, out->format == OUT_NDJSON ? "}\n" : "\n");
+    }
+    if (out->format == OUT_TEXT) out_str(out, TABLE_RULE);
+}
+
+// What a --budget scan reached: how many processes it walked before the
+// deadline, then the PIDs on either side of it in priority order (dealt
+// out per worker with --jobs), with the one or few the deadline caught
+// mid-table in between. Written
+// with the tables in text, to stderr when stdout is machine-readable.
+void display_budget_report(out_stream *out, const fd_snapshot *snap, double budget) {
+    const pid_array *lists[3] = {&snap->covered, &snap->partial, &snap->skipped};
+    static const char *titles[3] = {"Covered PIDs:", "Partial PIDs:", "Skipped PIDs:"};
+    FILE *to = out->format == OUT_TEXT ? NULL : stderr;
+    char line[160];
+
+    snprintf(line, sizeof(line), "\nScan budget: %g ms, %zu of %zu processes covered, %zu partially\n",
+             budget * 1000, snap->covered.count,
+             snap->covered.count + snap->partial.count + snap->skipped.count, snap->partial.count);
+    if (to != NULL) fputs(line, to);
+    else out_str(out, line);
+
+    for (int l = 0; l < 3; l++) {
+        if (to != NULL) fputs(titles[l], to);
+        else out_str(out, titles[l]);
+        for (size_t i = 0; i < lists[l]->count; i++) {
+            if (to != NULL) {
+                fprintf(to, " %d", lists[l]->pids[i]);
+                continue;
+            }
+            out_char(out, ' ');
+            out_int(out, lists[l]->pids[i]);
+        }
+        if (to != NULL) fputc('\n', to);
+        else out_char(out, '\n');
+    }
+}
+
+// Parse an --open-by query. "<dev>:<inode>" (decimal st_dev, as printed by
+// stat -c %d) is used as is; anything else is a path, stat-ed once here.
+// A path also matches the unlinked copies still open under it, which the
+// kernel reports as "PATH (deleted)": after a deploy replaces a file, the
+// holders of the old copy are found as well as those of the new one. A
+// path that no longer exists is matched against link targets alone.
+void parse_open_by(const char *query, open_by_query *q) {
+    memset(q, 0, sizeof(*q));
+    q->text = query;
+
+    char *end;
+    errno = 0;
+    unsigned long long dev = strtoull(query, &end, 10);
+    if (end != query && *end == ':' && isdigit((unsigned char)end[1])) {
+        char *end2;
+        unsigned long long ino = strtoull(end + 1, &end2, 10);
+        if (*end2 == '\0' && errno == 0) {
+            q->by_inode = 1;
+            q->dev = (dev_t)dev;
+            q->ino = (ino_t)ino;
+            return;
+        }
+    }
+
+    q->by_path = 1;
+    struct stat st;
+    if (stat(query, &st) == 0) {
+        q->by_inode = 1;
+        q->dev = st.st_dev;
+        q->ino = st.st_ino;
+    }
+    else if (errno != ENOENT) {
+        perror("Error reading --open-by path");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Hash the snapshot by (dev, inode) and by target string. Each table maps a
+// slot to the first record in it; next_* chain the records sharing a slot.
+void build_fd_index(fd_index *idx, const fd_snapshot *snap) {
+    idx->slot_count = 16;
+    while (idx->slot_count < snap->count * 2) {
+        idx->slot_count *= 2;
+    }
+    idx->inode_heads = malloc(idx->slot_count * sizeof(size_t));
+    idx->target_heads = malloc(idx->slot_count * sizeof(size_t));
+    idx->next_inode = malloc((snap->count + 1) * sizeof(size_t));
+    idx->next_target = malloc((snap->count + 1) * sizeof(size_t));
+    if (idx->inode_heads == NULL || idx->target_heads == NULL
+        || idx->next_inode == NULL || idx->next_target == NULL) {
+        perror("Error allocating fd index");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t s = 0; s < idx->slot_count; s++) {
+        idx->inode_heads[s] = FD_INDEX_END;
+        idx->target_heads[s] = FD_INDEX_END;
+    }
+
+    // Insert back to front so each chain lists records in snapshot order
+    for (size_t i = snap->count; i-- > 0; ) {
+        const fd_record *rec = &snap->records[i];
+        idx->next_inode[i] = FD_INDEX_END;
+        idx->next_target[i] = FD_INDEX_END;
+        if (rec->has_inode) {
+            size_t s = hash_inode(rec->dev, rec->inode) & (idx->slot_count - 1);
+            idx->next_inode[i] = idx->inode_heads[s];
+            idx->inode_heads[s] = i;
+        }
+        if (rec->has_target) {
+            size_t s = hash_string(rec->target) & (idx->slot_count - 1);
+            idx->next_target[i] = idx->target_heads[s];
+            idx->target_heads[s] = i;
+        }
+    }
+}
+
+void free_fd_index(fd_index *idx) {
+    free(idx->inode_heads);
+    free(idx->target_heads);
+    free(idx->next_inode);
+    free(idx->next_target);
+}
+
+// First record at or after chain position i holding (dev, ino); pass
+// FD_INDEX_START to begin. Returns FD_INDEX_END when there are no more.
+size_t fd_index_next_inode(const fd_index *idx, const fd_snapshot *snap, dev_t dev, ino_t ino, size_t i) {
+    i = i == FD_INDEX_START ? idx->inode_heads[hash_inode(dev, ino) & (idx->slot_count - 1)] : idx->next_inode[i];
+    while (i != FD_INDEX_END && (snap->records[i].dev != dev || snap->records[i].inode != ino)) {
+        i = idx->next_inode[i];
+    }
+    return i;
+}
+
+size_t fd_index_next_target(const fd_index *idx, const fd_snapshot *snap, const char *target, size_t i) {
+    i = i == FD_INDEX_START ? idx->target_heads[hash_string(target) & (idx->slot_count - 1)] : idx->next_target[i];
+    while (i != FD_INDEX_END && strcmp(snap->records[i].target, target) != 0) {
+        i = idx->next_target[i];
+    }
+    return i;
+}
+
+uint64_t hash_inode(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)dev + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2);
+    return h ^ (h >> 29);
+}
+
+// Print every descriptor that refers to the queried file
+void display_open_by(out_stream *out, const fd_snapshot *snap, const open_by_query *q) {
+    fd_index idx;
+    build_fd_index(&idx, snap);
+
+    if (out->format == OUT_TEXT) {
+        out_str(out, "\nProcesses with ");
+        out_str(out, q->text);
+        out_str(out, " open:\n");
+    }
+    composite_header(out, snap->sockets != NULL);
+
+    // Rows come out in scan order, each once even if it matches twice
+    char *keep = calloc(snap->count + 1, 1);
+    if (keep == NULL) {
+        perror("Error allocating open-by matches");
+        exit(EXIT_FAILURE);
+    }
+    mark_open_by(&idx, snap, q, keep);
+    for (size_t i = 0; i < snap->count; i++) {
+        if (keep[i]) {
+            write_record_row(out, &snap->records[i], snap->sockets);
+        }
+    }
+    composite_footer(out);
+    free(keep);
+    free_fd_index(&idx);
+}
+
+// Read the socket tables of our network namespace into an inode-keyed hash.
+// Sockets of processes in other namespaces simply won't be found.
+socket_table *load_socket_table(const char *proc_root, scan_stats *stats) {
+    static const struct { const char *name; int proto; } sources[] = {
+        {"net/tcp", SOCK_PROTO_TCP},
+        {"net/tcp6", SOCK_PROTO_TCP6},
+        {"net/udp", SOCK_PROTO_UDP},
+        {"net/udp6", SOCK_PROTO_UDP6},
+        {"net/unix", SOCK_PROTO_UNIX},
+    };
+    socket_table *table = calloc(1, sizeof(socket_table));
+    if (table == NULL) {
+        perror("Error allocating socket table");
+        exit(EXIT_FAILURE);
+    }
+    table->slot_count = 1024;
+    table->slots = calloc(table->slot_count, sizeof(socket_info));
+    table->paths_capacity = 4096;
+    table->paths = malloc(table->paths_capacity);
+    if (table->slots == NULL || table->paths == NULL) {
+        perror("Error allocating socket table");
+        exit(EXIT_FAILURE);
+    }
+
+    char line[MAX_LINE_LEN * 4];
+    // Sized for the root given, so a long --proc-root is never cut short
+    // into some other path
+    char path[strlen(proc_root) + sizeof("/net/tcp6")];
+    for (size_t s = 0; s < sizeof(sources) / sizeof(sources[0]); s++) {
+        snprintf(path, sizeof(path), "%s/%s", proc_root, sources[s].name);
+        FILE *file = fopen(path, "r");
+        stats->calls[SC_OPENAT]++;
+        if (file == NULL) { // no IPv6, no unix sockets: nothing to add
+            note_failure(stats, SC_OPENAT);
+            continue;
+        }
+
+        // Skip the column header line
+        if (fgets(line, sizeof(line), file) != NULL) {
+            while (fgets(line, sizeof(line), file) != NULL) {
+                socket_info info;
+                if (parse_socket_line(line, sources[s].proto, table, &info)) {
+                    socket_table_insert(table, &info);
+                }
+            }
+        }
+        fclose(file);
+        stats->calls[SC_CLOSE]++;
+    }
+    return table;
+}
+
+void free_socket_table(socket_table *table) {
+    if (table == NULL) return;
+    free(table->slots);
+    free(table->paths);
+    free(table);
+}
+
+// Split a /proc/net line into whitespace separated fields, in place
+int split_fields(char *line, char **fields, int max) {
+    int n = 0;
+    char *p = line;
+    while (n < max) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '\n') break;
+        fields[n++] = p;
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n') p++;
+        if (*p == '\0') break;
+        *p++ = '\0';
+    }
+    return n;
+}
+
+unsigned long parse_hex(const char *s, const char **end) {
+    unsigned long v = 0;
+    for (;; s++) {
+        int d;
+        if (*s >= '0' && *s <= '9') d = *s - '0';
+        else if (*s >= 'A' && *s <= 'F') d = *s - 'A' + 10;
+        else if (*s >= 'a' && *s <= 'f') d = *s - 'a' + 10;
+        else break;
+        v = (v << 4) | (unsigned long)d;
+    }
+    if (end != NULL) *end = s;
+    return v;
+}
+
+// "0100007F:1F90" -> address bytes and port. The kernel prints each 32-bit
+// word of the (network order) address as a native integer, so copying the
+// parsed words back out restores the original bytes.
+void parse_net_address(const char *field, int words, uint8_t *addr, uint16_t *port) {
+    char word[9];
+    for (int w = 0; w < words; w++) {
+        memcpy(word, field + w * 8, 8);
+        word[8] = '\0';
+        uint32_t v = (uint32_t)parse_hex(word, NULL);
+        memcpy(addr + w * 4, &v, 4);
+    }
+    const char *colon = field + words * 8;
+    *port = *colon == ':' ? (uint16_t)parse_hex(colon + 1, NULL) : 0;
+}
+
+int parse_socket_line(char *line, int proto, socket_table *table, socket_info *info) {
+    char *fields[8];
+    memset(info, 0, sizeof(*info));
+    info->proto = (uint8_t)proto;
+    info->path = UINT32_MAX;
+
+    if (proto == SOCK_PROTO_UNIX) {
+        // Num RefCount Protocol Flags Type St Inode [Path]. The path is
+        // the rest of the line after one space, and may hold spaces itself.
+        size_t line_len = strlen(line);
+        if (split_fields(line, fields, 7) < 7) return 0;
+        info->type = (uint8_t)parse_hex(fields[4], NULL);
+        info->state = (uint8_t)parse_hex(fields[5], NULL);
+        info->inode = strtoull(fields[6], NULL, 10);
+        char *rest = fields[6] + strlen(fields[6]) + 1;
+        if (rest > line + line_len) rest = line + line_len; // the inode ended the line
+        rest[strcspn(rest, "\n")] = '\0';
+        if (*rest != '\0') {
+            size_t len = strlen(rest) + 1;
+            while (table->paths_size + len > table->paths_capacity) {
+                table->paths_capacity *= 2;
+                table->paths = realloc(table->paths, table->paths_capacity);
+                if (table->paths == NULL) {
+                    perror("Error allocating socket table");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            info->path = (uint32_t)table->paths_size;
+            memcpy(table->paths + table->paths_size, rest, len);
+            table->paths_size += len;
+        }
+    }
+    else {
+        // sl local rem st tx:rx tr:when retrnsmt uid timeout inode ...
+        char *all[10];
+        if (split_fields(line, all, 10) < 10) return 0;
+        int words = (proto == SOCK_PROTO_TCP6 || proto == SOCK_PROTO_UDP6) ? 4 : 1;
+        parse_net_address(all[1], words, info->local_addr, &info->local_port);
+        parse_net_address(all[2], words, info->remote_addr, &info->remote_port);
+        info->state = (uint8_t)parse_hex(all[3], NULL);
+        info->inode = strtoull(all[9], NULL, 10);
+    }
+    return info->inode != 0;
+}
+
+void socket_table_insert(socket_table *table, const socket_info *info) {
+    // Keep the load factor under 1/2 by rehashing into twice the slots
+    if ((table->used + 1) * 2 > table->slot_count) {
+        size_t old_count = table->slot_count;
+        socket_info *old_slots = table->slots;
+        table->slot_count *= 2;
+        table->slots = calloc(table->slot_count, sizeof(socket_info));
+        if (table->slots == NULL) {
+            perror("Error allocating socket table");
+            exit(EXIT_FAILURE);
+        }
+        table->used = 0;
+        for (size_t i = 0; i < old_count; i++) {
+            if (old_slots[i].inode != 0) {
+                socket_table_insert(table, &old_slots[i]);
+            }
+        }
+        free(old_slots);
+    }
+
+    size_t mask = table->slot_count - 1;
+    size_t slot = hash_inode(0, (ino_t)info->inode) & mask;
+    while (table->slots[slot].inode != 0 && table->slots[slot].inode != info->inode) {
+        slot = (slot + 1) & mask;
+    }
+    if (table->slots[slot].inode == 0) {
+        table->used++;
+    }
+    table->slots[slot] = *info;
+}
+
+const socket_info *socket_table_find(const socket_table *table, uint64_t inode) {
+    size_t mask = table->slot_count - 1;
+    size_t slot = hash_inode(0, (ino_t)inode) & mask;
+    while (table->slots[slot].inode != 0) {
+        if (table->slots[slot].inode == inode) {
+            return &table->slots[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+// For a "socket:[N]" target, append " proto local -> remote STATE" when the
+// socket is in the table
+void out_socket_annotation(out_stream *out, const socket_table *table, const char *target, int format) {
+    static const char *tcp_states[] = {
+        "", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2", "TIME_WAIT",
+        "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING", "NEW_SYN_RECV"
+    };
+    static const char *proto_names[] = {"tcp", "tcp6", "udp", "udp6", "unix"};
+
+    if (table == NULL || strncmp(target, "socket:[", 8) != 0) return;
+    const socket_info *info = socket_table_find(table, strtoull(target + 8, NULL, 10));
+    if (info == NULL) return;
+
+    // In text the annotation trails the target; elsewhere it is a field
+    if (format == OUT_TEXT) {
+        out_char(out, ' ');
+    }
+    out_str(out, proto_names[info->proto]);
+
+    if (info->proto == SOCK_PROTO_UNIX) {
+        out_str(out, info->type == 1 ? " STREAM" : info->type == 2 ? " DGRAM" : " SEQPACKET");
+        out_str(out, info->state == 3 ? " CONNECTED" : " UNCONNECTED");
+        if (info->path != UINT32_MAX) {
+            out_char(out, ' ');
+            out_escaped(out, table->paths + info->path, format);
+        }
+        return;
+    }
+
+    int family = (info->proto == SOCK_PROTO_TCP6 || info->proto == SOCK_PROTO_UDP6) ? AF_INET6 : AF_INET;
+    out_char(out, ' ');
+    out_address(out, family, info->local_addr, info->local_port);
+    out_str(out, " -> ");
+    out_address(out, family, info->remote_addr, info->remote_port);
+    out_char(out, ' ');
+    if (info->proto == SOCK_PROTO_TCP || info->proto == SOCK_PROTO_TCP6) {
+        out_str(out, info->state < sizeof(tcp_states) / sizeof(tcp_states[0]) ? tcp_states[info->state] : "?");
+    }
+    else {
+        out_str(out, info->state == 1 ? "ESTABLISHED" : "UNCONN");
+    }
+}
+
+void out_address(out_stream *out, int family, const uint8_t *addr, uint16_t port) {
+    char text[INET6_ADDRSTRLEN];
+    if (inet_ntop(family, addr, text, sizeof(text)) == NULL) {
+        text[0] = '?';
+        text[1] = '\0';
+    }
+    if (family == AF_INET6) {
+        out_char(out, '[');
+        out_str(out, text);
+        out_char(out, ']');
+    }
+    else {
+        out_str(out, text);
+    }
+    out_char(out, ':');
+    out_uint(out, port);
+}
+
+// Keep rescanning every interval seconds, printing only what changed. The
+// previous tick is kept per PID; a process is rescanned only when it is new
+// or when its fd directory's size (the open fd count on Linux >= 6.2) or
+// mtime moved. Older kernels report a size of 0, so there every process is
+// rescanned on every tick. procfs leaves that mtime alone, so a close and
+// open that keep the count (a dup2 over a live fd, say) go unseen until the
+// process is rescanned anyway: every WATCH_RECHECK_TICKS ticks, spread
+// over the ticks by PID so each one rescans a slice.
+void watch_descriptors(out_stream *out, const scan_options *opts, double interval, int show_stats) {
+    watch_entry *entries = NULL;
+    size_t nentries = 0;
+    struct timespec pause;
+    pause.tv_sec = (time_t)interval;
+    pause.tv_nsec = (long)((interval - (double)pause.tv_sec) * 1e9);
+
+    // Baseline: one regular (possibly parallel) scan, split up per PID
+    fd_snapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    collect_or_exit(&snap, opts);
+    display_composed_table(out, &snap, opts->pid);
+    out_flush(out);
+    if (show_stats) {
+        print_scan_stats(&snap.stats, show_stats);
+    }
+
+    int proc_fd = open(opts->proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_fd == -1) {
+        perror("Error opening /proc directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int sizes_reported = kernel_reports_fd_counts(proc_fd);
+
+    // Every process the scan walked gets an entry, those that had no rows
+    // (no fds, or all filtered out) as well, so they are not taken for new
+    // processes on the first tick
+    qsort(snap.records, snap.count, sizeof(fd_record), compare_record_key);
+    qsort(snap.procs, snap.nprocs, sizeof(proc_count), compare_proc_pid);
+    entries = malloc((snap.nprocs + 1) * sizeof(watch_entry));
+    if (entries == NULL) {
+        perror("Error allocating watch state");
+        exit(EXIT_FAILURE);
+    }
+    size_t r = 0;
+    for (size_t p = 0; p < snap.nprocs; p++) {
+        while (r < snap.count && snap.records[r].pid < snap.procs[p].pid) r++;
+        size_t i = r;
+        while (r < snap.count && snap.records[r].pid == snap.procs[p].pid) r++;
+
+        watch_entry *e = &entries[nentries++];
+        memset(e, 0, sizeof(*e));
+        e->pid = snap.procs[p].pid;
+        // No fingerprint yet: force a rescan on the first tick
+        e->fd_count = -1;
+        if (r == i) continue;
+        e->fds.records = malloc((r - i) * sizeof(fd_record));
+        if (e->fds.records == NULL) {
+            perror("Error allocating watch state");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(e->fds.records, &snap.records[i], (r - i) * sizeof(fd_record));
+        e->fds.count = e->fds.capacity = r - i;
+        for (size_t k = 0; k < e->fds.count; k++) {
+            if (e->fds.records[k].has_target) {
+                e->fds.records[k].target = arena_intern(&e->fds.strings, e->fds.records[k].target);
+                if (e->fds.records[k].target == NULL) {
+                    perror("Error allocating watch state");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+    free_snapshot(&snap);
+
+    for (unsigned long ticks = 1; ; ticks++) {
+        nanosleep(&pause, NULL);
+
+        scan_stats tick;
+        memset(&tick, 0, sizeof(tick));
+        double started = now_seconds();
+        phase_mark mark;
+        phase_start(&mark);
+
+        pid_t *pids;
+        size_t npids;
+        if (opts->pid != -1) {
+            pids = malloc(sizeof(pid_t));
+            if (pids == NULL) {
+                perror("Error allocating PID list");
+                exit(EXIT_FAILURE);
+            }
+            pids[0] = opts->pid;
+            npids = 1;
+        }
+        else {
+            lseek(proc_fd, 0, SEEK_SET);
+            ssize_t listed = list_pids(proc_fd, &pids, &tick);
+            if (listed == -1) {
+                perror("Error reading /proc directory");
+                exit(EXIT_FAILURE);
+            }
+            npids = (size_t)listed;
+            qsort(pids, npids, sizeof(pid_t), compare_pid);
+        }
+        phase_stop(&tick, PH_LIST, &mark);
+        phase_start(&mark);
+
+        watch_entry *next = malloc((npids + 1) * sizeof(watch_entry));
+        if (next == NULL) {
+            perror("Error allocating watch state");
+            exit(EXIT_FAILURE);
+        }
+        size_t nnext = 0, i = 0, j = 0;
+
+        // Merge the sorted previous entries with the sorted current PIDs
+        while (i < nentries || j < npids) {
+            if (j == npids || (i < nentries && entries[i].pid < pids[j])) {
+                // Process exited: everything it held is closed
+                print_fd_deltas(out, &entries[i].fds, NULL);
+                free_snapshot(&entries[i].fds);
+                i++;
+                continue;
+            }
+
+            watch_entry *prev = (i < nentries && entries[i].pid == pids[j]) ? &entries[i] : NULL;
+            watch_entry *cur = &next[nnext];
+            char fd_dir_name[32];
+            struct stat st;
+
+            snprintf(fd_dir_name, sizeof(fd_dir_name), "%d/fd", pids[j]);
+            tick.calls[SC_FSTATAT]++;
+            if (fstatat(proc_fd, fd_dir_name, &st, 0) == -1) {
+                note_failure(&tick, SC_FSTATAT);
+                // Gone (or never ours) since the listing; treat as exited
+                if (prev != NULL) {
+                    print_fd_deltas(out, &prev->fds, NULL);
+                    free_snapshot(&prev->fds);
+                    i++;
+                }
+                j++;
+                continue;
+            }
+
+            int recheck = (ticks + (unsigned long)pids[j]) % WATCH_RECHECK_TICKS == 0;
+            if (prev != NULL && sizes_reported && !recheck && st.st_size == prev->fd_count
+                && st.st_mtim.tv_sec == prev->mtime.tv_sec && st.st_mtim.tv_nsec == prev->mtime.tv_nsec) {
+                // Unchanged: carry the previous records over untouched
+                *cur = *prev;
+            }
+            else {
+                memset(cur, 0, sizeof(*cur));
+                cur->pid = pids[j];
+                int rc = collect_pid(&cur->fds, proc_fd, pids[j], opts, NULL, 0);
+                if (rc == -1) {
+                    perror("Error scanning /proc directory");
+                    exit(EXIT_FAILURE);
+                }
+                if (rc == 0) {
+                    qsort(cur->fds.records, cur->fds.count, sizeof(fd_record), compare_record_fd);
+                }
+                merge_stats(&tick, &cur->fds.stats);
+                free(cur->fds.stats.timing);
+                cur->fds.stats.timing = NULL;
+                print_fd_deltas(out, prev != NULL ? &prev->fds : NULL, &cur->fds);
+                if (prev != NULL) {
+                    free_snapshot(&prev->fds);
+                }
+            }
+            cur->fd_count = st.st_size;
+            cur->mtime = st.st_mtim;
+            nnext++;
+            if (prev != NULL) i++;
+            j++;
+        }
+
+        free(entries);
+        free(pids);
+        entries = next;
+        nentries = nnext;
+        tick.scan_seconds = now_seconds() - started;
+        phase_stop(&tick, PH_WALK, &mark);
+
+        phase_start(&mark);
+        out_flush(out);
+        phase_stop(&tick, PH_OUTPUT, &mark);
+        if (show_stats) {
+            print_scan_stats(&tick, show_stats);
+        }
+        free(tick.timing);
+    }
+}
+
+// Print the rows that disappeared from before ("-") and appeared in after
+// ("+"). Both hold one process's records sorted by fd; either may be NULL.
+void print_fd_deltas(out_stream *out, const fd_snapshot *before, const fd_snapshot *after) {
+    size_t nb = before != NULL ? before->count : 0;
+    size_t na = after != NULL ? after->count : 0;
+    size_t i = 0, j = 0;
+
+    while (i < nb || j < na) {
+        const fd_record *b = i < nb ? &before->records[i] : NULL;
+        const fd_record *a = j < na ? &after->records[j] : NULL;
+
+        if (a == NULL || (b != NULL && b->fd < a->fd)) {
+            print_fd_delta(out, '-', b);
+            i++;
+        }
+        else if (b == NULL || a->fd < b->fd) {
+            print_fd_delta(out, '+', a);
+            j++;
+        }
+        else {
+            // Same fd number: reported only if it now refers to another file
+            if (a->inode != b->inode || a->dev != b->dev || strcmp(a->target, b->target) != 0) {
+                print_fd_delta(out, '-', b);
+                print_fd_delta(out, '+', a);
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+void print_fd_delta(out_stream *out, char op, const fd_record *rec) {
+    if (!rec->has_target) return;
+    out_char(out, op);
+    out_char(out, '\t');
+    write_composite_row(out, rec->pid, rec->fd, rec->target, rec->inode, NULL);
+}
+
+// Sample every process's fd count every interval seconds and report the
+// processes whose count keeps climbing. Each tick is a count-only scan
+// merged by PID into the previous tick's entries, which drops the processes
+// that exited; the entries hold a fixed window of samples, so memory
+// follows the number of processes rather than the length of the run. Only
+// a process that starts trending up is scanned in full, once, to show what
+// kind of descriptor it is piling up. A PID whose start time changed is a
+// new process and starts a new window; the start time is only read when a
+// PID appears, when its count drops, and before it is flagged, since a
+// reused PID shows up as a drop or as a climb the old process didn't make.
+// Never returns.
+void track_leaks(out_stream *out, const scan_options *opts, double interval, int samples) {
+    leak_entry *entries = NULL, *next = NULL;
+    size_t nentries = 0, capacity = 0;
+    fd_snapshot snap, detail;
+    memset(&snap, 0, sizeof(snap));
+    memset(&detail, 0, sizeof(detail));
+    struct timespec pause;
+    pause.tv_sec = (time_t)interval;
+    pause.tv_nsec = (long)((interval - (double)pause.tv_sec) * 1e9);
+
+    out_str(out, "Sampling fd counts; a process is flagged when its count grew by at least ");
+    out_uint(out, LEAK_MIN_GROWTH);
+    out_str(out, " over the last ");
+    out_uint(out, (unsigned long)samples);
+    out_str(out, " samples and fell in at most a quarter of them\n");
+    out_flush(out);
+
+    int proc_fd = open(opts->proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_fd == -1) {
+        perror("Error opening /proc directory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        collect_or_exit(&snap, opts);
+        qsort(snap.procs, snap.nprocs, sizeof(proc_count), compare_proc_pid);
+        if (snap.nprocs > capacity) {
+            capacity = snap.nprocs * 2;
+            free(next);
+            next = malloc(capacity * sizeof(leak_entry));
+            leak_entry *grown = realloc(entries, capacity * sizeof(leak_entry));
+            if (next == NULL || grown == NULL) {
+                perror("Error allocating leak state");
+                exit(EXIT_FAILURE);
+            }
+            entries = grown;
+        }
+
+        size_t nnext = 0, i = 0;
+        for (size_t j = 0; j < snap.nprocs; j++) {
+            const proc_count *proc = &snap.procs[j];
+            for (; i < nentries && entries[i].pid < proc->pid; i++) {
+                if (entries[i].flagged) {
+                    out_str(out, "gone\t");
+                    out_int(out, entries[i].pid);
+                    out_char(out, '\n');
+                }
+            }
+
+            leak_entry *e = &next[nnext++];
+            uint32_t fds = (uint32_t)proc->fds;
+            if (i < nentries && entries[i].pid == proc->pid) {
+                *e = entries[i++];
+                uint32_t last = e->counts[(e->head + (unsigned int)samples - 1) % (unsigned int)samples];
+                if (fds < last) {
+                    leak_pid_reused(out, proc_fd, e);
+                }
+            }
+            else {
+                memset(e, 0, sizeof(*e));
+                e->pid = proc->pid;
+                e->start = process_start(proc_fd, proc->pid);
+            }
+            leak_push(e, fds, samples);
+
+            double rate;
+            int steady;
+            int trending = leak_trend(e, samples, interval, &rate, &steady);
+            if (trending && !e->flagged && leak_pid_reused(out, proc_fd, e)) {
+                leak_push(e, fds, samples);
+                trending = 0;
+            }
+            if (trending && !e->flagged) {
+                print_leak(out, &detail, opts, e, samples, rate, steady);
+            }
+            else if (!trending && e->flagged) {
+                out_str(out, "ok\t");
+                out_int(out, e->pid);
+                out_char(out, '\t');
+                out_uint(out, proc->fds);
+                out_char(out, '\n');
+            }
+            e->flagged = trending;
+        }
+        for (; i < nentries; i++) {
+            if (entries[i].flagged) {
+                out_str(out, "gone\t");
+                out_int(out, entries[i].pid);
+                out_char(out, '\n');
+            }
+        }
+
+        leak_entry *swap = entries;
+        entries = next;
+        next = swap;
+        nentries = nnext;
+        out_flush(out);
+        nanosleep(&pause, NULL);
+    }
+}
+
+void leak_push(leak_entry *e, uint32_t fds, int samples) {
+    e->counts[e->head] = fds;
+    e->head = (e->head + 1) % (unsigned int)samples;
+    if (e->filled < (unsigned int)samples) {
+        e->filled++;
+    }
+}
+
+// Whether e->pid now belongs to another process than the one e has been
+// sampling. If so the old one is reported gone (when it was flagged) and e
+// starts a new, empty window for the new one.
+int leak_pid_reused(out_stream *out, int proc_fd, leak_entry *e) {
+    unsigned long long start = process_start(proc_fd, e->pid);
+    if (start == 0) return 0;
+    if (e->start == 0 || start == e->start) {
+        e->start = start;
+        return 0;
+    }
+    if (e->flagged) {
+        out_str(out, "gone\t");
+        out_int(out, e->pid);
+        out_char(out, '\n');
+    }
+    pid_t pid = e->pid;
+    memset(e, 0, sizeof(*e));
+    e->pid = pid;
+    e->start = start;
+    return 1;
+}
+
+// Whether e's full window of samples trends up: grown by LEAK_MIN_GROWTH or
+// more, with at most a quarter of the steps going down. rate is the least
+// squares slope in fds per second, steady the percentage of steps that did
+// not go down.
+int leak_trend(const leak_entry *e, int samples, double interval, double *rate, int *steady) {
+    if (e->filled < (unsigned int)samples) return 0;
+
+    // With a full ring, head is the oldest sample
+    double sum_y = 0, sum_xy = 0;
+    int falls = 0;
+    uint32_t prev = 0;
+    for (int x = 0; x < samples; x++) {
+        uint32_t y = e->counts[(e->head + (unsigned int)x) % (unsigned int)samples];
+        sum_y += y;
+        sum_xy += (double)x * y;
+        if (x > 0 && y < prev) falls++;
+        prev = y;
+    }
+    double n = samples;
+    double sum_x = n * (n - 1) / 2;
+    double sum_xx = n * (n - 1) * (2 * n - 1) / 6;
+    *rate = (n * sum_xy - sum_x * sum_y) / (n * sum_xx - sum_x * sum_x) / interval;
+    *steady = (samples - 1 - falls) * 100 / (samples - 1);
+
+    uint32_t first = e->counts[e->head];
+    return prev >= first + LEAK_MIN_GROWTH && falls * 4 <= samples - 1;
+}
+
+// One flagged process: its count over the window, growth rate and
+// steadiness, then its descriptors by type from a scan of that process alone
+void print_leak(out_stream *out, fd_snapshot *detail, const scan_options *opts, const leak_entry *e,
+                int samples, double rate, int steady) {
+    char line[128];
+    uint32_t first = e->counts[e->head];
+    uint32_t last = e->counts[(e->head + (unsigned int)samples - 1) % (unsigned int)samples];
+    snprintf(line, sizeof(line), "LEAK\t%d\t%u -> %u\t%+.2f/s\t%d%% steady", (int)e->pid, first, last, rate,
+             steady);
+    out_str(out, line);
+
+    scan_options one = *opts;
+    one.pid = e->pid;
+    one.count_only = 0;
+    one.jobs = 1;
+    // A process we may not read (or that just exited) is flagged all the
+    // same, only without the breakdown
+    if (collect_snapshot(detail, &one) == -1 || detail->pid_error != 0) {
+        out_char(out, '\n');
+        return;
+    }
+    unsigned long types[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < detail->count; i++) {
+        if (!detail->records[i].has_target) continue;
+        switch (fd_type_of(detail->records[i].target)) {
+            case FD_TYPE_FILE: types[0]++; break;
+            case FD_TYPE_SOCKET: types[1]++; break;
+            case FD_TYPE_PIPE: types[2]++; break;
+            default: types[3]++; break;
+        }
+    }
+    snprintf(line, sizeof(line), "\tfile=%lu socket=%lu pipe=%lu anon=%lu\n", types[0], types[1], types[2],
+             types[3]);
+    out_str(out, line);
+}
+
+// Start time of pid in clock ticks after boot: field 22 of /proc/<pid>/stat,
+// counted after the parenthesized comm, which may contain spaces. 0 when
+// it cannot be read.
+unsigned long long process_start(int proc_fd, pid_t pid) {
+    char path[32], buf[512];
+    snprintf(path, sizeof(path), "%d/stat", pid);
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+
+    const char *p = strrchr(buf, ')');
+    if (p == NULL) return 0;
+    // Fields 3 (state) to 21 come before it
+    for (int field = 3; field <= 22; field++) {
+        p = strchr(p + 1, ' ');
+        if (p == NULL) return 0;
+    }
+    return strtoull(p + 1, NULL, 10);
+}
+
+int compare_record_fd(const void *a, const void *b) {
+    int fa = ((const fd_record *)a)->fd;
+    int fb = ((const fd_record *)b)->fd;
+    return (fa > fb) - (fa < fb);
+}
+
+int compare_proc_pid(const void *a, const void *b) {
+    pid_t pa = ((const proc_count *)a)->pid;
+    pid_t pb = ((const proc_count *)b)->pid;
+    return (pa > pb) - (pa < pb);
+}
+
+int compare_pid(const void *a, const void *b) {
+    pid_t pa = *(const pid_t *)a;
+    pid_t pb = *(const pid_t *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+int isPid(char *string){
+    int res = 1;
+    for (int i=0; string[i]!='\0';i++){
+        if (!isdigit(string[i])){
+            res = 0;
+        }
+    }
+    return res;
+}
+
+// Add a file sink. Two sinks on one path would race to write it, so a
+// path given twice is an error.
+void add_sink(file_sink *sinks, int *nsinks, int kind, int format, const char *path) {
+    for (int i = 0; i < *nsinks; i++) {
+        if (strcmp(sinks[i].path, path) == 0) {
+            printf("Output file given twice: %s\n", path);
+            display_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (*nsinks == MAX_SINKS) {
+        printf("At most %d output files\n", MAX_SINKS);
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+    file_sink *sink = &sinks[(*nsinks)++];
+    memset(sink, 0, sizeof(*sink));
+    sink->kind = kind;
+    sink->format = format;
+    sink->path = path;
+}
+
+// Start one writer thread per sink on snap, which must not change until
+// finish_sinks returns
+void start_sinks(file_sink *sinks, int nsinks, const fd_snapshot *snap, pid_t pid) {
+    for (int i = 0; i < nsinks; i++) {
+        sinks[i].snap = snap;
+        sinks[i].pid = pid;
+        int err = pthread_create(&sinks[i].thread, NULL, sink_main, &sinks[i]);
+        if (err != 0) {
+            errno = err;
+            perror("Error starting output writer");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void finish_sinks(file_sink *sinks, int nsinks) {
+    for (int i = 0; i < nsinks; i++) {
+        pthread_join(sinks[i].thread, NULL);
+    }
+}
+
+void *sink_main(void *arg) {
+    file_sink *sink = arg;
+    if (sink->kind == SINK_BINARY) {
+        save_composite_table_binary(sink->path, sink->snap, sink->pid);
     }
+    else {
+        save_composite_table_text(sink->path, sink->snap, sink->pid, sink->format);
+    }
+    return NULL;
+}
 
-    // Display requested tables
-    if (per_process){
-        display_process_fd_table(pid);
+void save_composite_table_text(const char *filename, const fd_snapshot *snap, pid_t pid, int format) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror("Error opening file for writing");
+        exit(EXIT_FAILURE);
     }
-    if (system_wide){
-        display_systemwide_fd_table(pid);
+
+    // Display the composite table into the file through its own writer
+    out_stream out;
+    out_open(&out, fileno(file), 0);
+    out.format = format;
+    display_composed_table(&out, snap, pid);
+    if (out_close(&out) == -1) {
+        perror("Error writing text table");
+        exit(EXIT_FAILURE);
     }
-    if (vnodes){
-        display_vnodes_fd_table(pid);
+
+    // Close the file
+    fclose(file);
+}
+
+// Write the snapshot rows for pid (or every PID) in the versioned binary
+// format described at the top of this file. Straight from memory: no second
+// scan and no subprocess.
+void save_composite_table_binary(const char *filename, const fd_snapshot *snap, pid_t pid) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror("Error opening file for writing");
+        exit(EXIT_FAILURE);
     }
-    if (composite){
-        display_composed_table(pid);
+
+    char *blob;
+    size_t size = encode_snapshot(snap, pid, NULL, &blob);
+    if (fwrite(blob, 1, size, file) != size) {
+        perror("Error writing binary snapshot");
+        exit(EXIT_FAILURE);
     }
 
-    // Flag offending processes if threshold is provided
-    if (threshold != -1){
-        flag_offending_processes(threshold);
+    free(blob);
+    fclose(file);
+}
+
+// Serialize the rows for pid (or every PID) into one malloc'ed blob; when
+// keep is given, only records i with keep[i] set are written. Returns the
+// blob size. Files and daemon replies share this encoding.
+size_t encode_snapshot(const fd_snapshot *snap, pid_t pid, const char *keep, char **blob) {
+    snapshot_file_record *records = malloc((snap->count + 1) * sizeof(snapshot_file_record));
+    snapshot_file_index *index = malloc((snap->count + 1) * sizeof(snapshot_file_index));
+    string_table strings;
+    strings.size = 0;
+    strings.capacity = 4096;
+    strings.data = malloc(strings.capacity);
+    strings.used = 0;
+    strings.slot_count = 1024;
+    strings.slots = malloc(strings.slot_count * sizeof(uint32_t));
+    if (records == NULL || index == NULL || strings.data == NULL || strings.slots == NULL) {
+        perror("Error allocating binary snapshot");
+        exit(EXIT_FAILURE);
     }
+    memset(strings.slots, 0xff, strings.slot_count * sizeof(uint32_t));
+
+    // Records of one PID are contiguous in the snapshot, so the index is
+    // built in the same pass
+    size_t nrecords = 0, nindex = 0;
+    for (size_t i = 0; i < snap->count; i++) {
+        const fd_record *rec = &snap->records[i];
+        if (pid != -1 && rec->pid != pid) continue;
+        if (keep != NULL && !keep[i]) continue;
+
+        if (nindex == 0 || index[nindex - 1].pid != rec->pid) {
+            index[nindex].pid = rec->pid;
+            index[nindex].count = 0;
+            index[nindex].first = nrecords;
+            nindex++;
+        }
+        index[nindex - 1].count++;
 
-    // output the stdout as a text file or binary file
-    if (save_text){
-        save_composite_table_text("compositeTable.txt",pid);
+        snapshot_file_record *out = &records[nrecords++];
+        out->pid = rec->pid;
+        out->fd = rec->fd;
+        out->target = rec->has_target ? intern_string(&strings, rec->target) : SNAPSHOT_NO_TARGET;
+        out->mode = rec->has_inode ? (uint32_t)rec->mode : 0;
+        out->inode = rec->has_inode ? (uint64_t)rec->inode : 0;
+        out->dev = rec->has_inode ? (uint64_t)rec->dev : 0;
     }
-    if (save_binary){
-        save_composite_table_binary("compositeTable.bin",pid);
+    qsort(index, nindex, sizeof(snapshot_file_index), compare_file_index);
+
+    snapshot_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(header);
+    header.created = snap->scanned != 0 ? (int64_t)snap->scanned : (int64_t)time(NULL);
+    header.record_count = nrecords;
+    header.records_offset = sizeof(header);
+    header.index_count = nindex;
+    header.index_offset = header.records_offset + nrecords * sizeof(snapshot_file_record);
+    header.strings_size = strings.size;
+    header.strings_offset = header.index_offset + nindex * sizeof(snapshot_file_index);
+
+    size_t size = header.strings_offset + strings.size;
+    *blob = malloc(size);
+    if (*blob == NULL) {
+        perror("Error allocating binary snapshot");
+        exit(EXIT_FAILURE);
     }
+    memcpy(*blob, &header, sizeof(header));
+    memcpy(*blob + header.records_offset, records, nrecords * sizeof(snapshot_file_record));
+    memcpy(*blob + header.index_offset, index, nindex * sizeof(snapshot_file_index));
+    memcpy(*blob + header.strings_offset, strings.data, strings.size);
+
+    free(records);
+    free(index);
+    free(strings.data);
+    free(strings.slots);
+    return size;
+}
 
+// Check a mapped or received blob before any of its arrays are used. The
+// string table must end in a NUL so that no target can run off the end.
+int snapshot_valid(const char *base, size_t size) {
+    if (size < sizeof(snapshot_file_header)) return 0;
+    const snapshot_file_header *header = (const snapshot_file_header *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SNAPSHOT_VERSION
+        || !blob_array_fits(header->records_offset, header->record_count, sizeof(snapshot_file_record), size)
+        || !blob_array_fits(header->index_offset, header->index_count, sizeof(snapshot_file_index), size)
+        || !blob_array_fits(header->strings_offset, header->strings_size, 1, size)) {
+        return 0;
+    }
+    return header->strings_size == 0
+        || base[header->strings_offset + header->strings_size - 1] == '\0';
+}
 
-    printf("\n*******Program Terminated Successfuly!*******\n");
+// count items of item_size starting at offset lie within size bytes,
+// checked without letting offset + count * item_size wrap
+int blob_array_fits(uint64_t offset, uint64_t count, size_t item_size, size_t size) {
+    return offset <= size && count <= (size - offset) / item_size;
+}
 
-    return 0;
+// Print the composite table stored in a binary snapshot. The file is mapped
+// read-only and used in place; a PID lookup is a binary search of the index.
+void read_composite_table_binary(out_stream *out, const char *filename, pid_t pid) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Error opening binary snapshot");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading binary snapshot");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(snapshot_file_header)) {
+        fprintf(stderr, "Not a binary snapshot: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Error mapping binary snapshot");
+        exit(EXIT_FAILURE);
+    }
+    if (!snapshot_valid(base, size)) {
+        fprintf(stderr, "Not a binary snapshot (or unsupported version): %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    composite_header(out, 0);
+    write_binary_rows(out, base, pid);
+    composite_footer(out);
+
+    munmap((void *)base, size);
 }
 
-void display_process_fd_table(pid_t pid) {
-    char proc_fd_path[MAX_PATH_LEN];
-    DIR *dir;
-    struct dirent *entry;
+// Composite rows of a validated binary snapshot, for pid or every PID
+void write_binary_rows(out_stream *out, const char *base, pid_t pid) {
+    const snapshot_file_header *header = (const snapshot_file_header *)base;
+    const snapshot_file_record *records = (const snapshot_file_record *)(base + header->records_offset);
+    const snapshot_file_index *index = (const snapshot_file_index *)(base + header->index_offset);
+    const char *strings = base + header->strings_offset;
 
-    printf("PID\tFD\n");
-    printf("========================================\n");
+    uint64_t first = 0, count = header->record_count;
+    if (pid != -1) {
+        snapshot_file_index key;
+        key.pid = pid;
+        const snapshot_file_index *hit = bsearch(&key, index, header->index_count,
+                                                 sizeof(snapshot_file_index), compare_file_index);
+        first = hit != NULL ? hit->first : 0;
+        count = hit != NULL ? hit->count : 0;
+    }
 
-    if(pid!=-1 && kill(pid, 0) != -1){ // PID is specified
-        snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%d/fd", pid);
-        dir = opendir(proc_fd_path);
-        if (dir == NULL) {
-            perror("Error opening directory\n");
-            exit(EXIT_FAILURE);
-        }
+    for (uint64_t i = first; i - first < count && i < header->record_count; i++) {
+        const snapshot_file_record *rec = &records[i];
+        if (rec->target == SNAPSHOT_NO_TARGET || rec->target >= header->strings_size || rec->mode == 0) continue;
+        write_composite_row(out, rec->pid, rec->fd, strings + rec->target, (unsigned long)rec->inode, NULL);
+    }
+}
 
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                char fd_path[MAX_PATH_LEN];
-                char filename[MAX_FILENAME_LEN];
-                ssize_t readlink_size;
+// Scan every interval seconds and append the result to the history log at
+// path: a keyframe every keyframe_every frames (and always first, since
+// what an existing log last saw is unknown), a delta of the rows that
+// changed otherwise. Unchanged scans write nothing. Never returns.
+void record_history(const char *path, const scan_options *opts, double interval, int keyframe_every) {
+    char index_path[strlen(path) + sizeof(".idx")];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    int fd = open_history_file(path, HISTORY_MAGIC);
+    int index_fd = open_history_file(index_path, HISTORY_INDEX_MAGIC);
 
-                snprintf(fd_path, MAX_PATH_LEN, "%s/%s", proc_fd_path, entry->d_name);
-                readlink_size = readlink(fd_path, filename, MAX_FILENAME_LEN - 1);
-                if (readlink_size != -1) {
-                    filename[readlink_size] = '\0';
-                    printf("%d\t%s\n", pid, entry->d_name);
-                } 
-                else {
-                    perror("Error reading link\n");
+    struct timespec pause;
+    pause.tv_sec = (time_t)interval;
+    pause.tv_nsec = (long)((interval - (double)pause.tv_sec) * 1e9);
+
+    // Two snapshots take turns as the previous and the current scan
+    fd_snapshot snaps[2];
+    memset(snaps, 0, sizeof(snaps));
+    char *closed = NULL, *opened = NULL;
+    size_t marks_capacity = 0;
+
+    for (unsigned long tick = 0; ; tick++) {
+        fd_snapshot *prev = &snaps[(tick + 1) % 2];
+        fd_snapshot *cur = &snaps[tick % 2];
+        collect_or_exit(cur, opts);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        qsort(cur->records, cur->count, sizeof(fd_record), compare_record_key);
+
+        char *first, *second = NULL;
+        size_t first_size, second_size = 0;
+        if (tick % (unsigned long)keyframe_every == 0) {
+            first_size = encode_snapshot(cur, -1, NULL, &first);
+            write_history_frame(fd, index_fd, HISTORY_KEYFRAME, time_ms, first, first_size, NULL, 0);
+            printf("%.3f\tkeyframe\t%zu rows\t%zu bytes\n", time_ms / 1000.0, cur->count, first_size);
+            free(first);
+        }
+        else {
+            size_t need = prev->count > cur->count ? prev->count : cur->count;
+            if (need + 1 > marks_capacity) {
+                marks_capacity = (need + 1) * 2;
+                free(closed);
+                free(opened);
+                closed = malloc(marks_capacity);
+                opened = malloc(marks_capacity);
+                if (closed == NULL || opened == NULL) {
+                    perror("Error allocating history delta");
+                    exit(EXIT_FAILURE);
                 }
             }
+            size_t changes = mark_deltas(prev, cur, closed, opened);
+            if (changes > 0) {
+                first_size = encode_snapshot(prev, -1, closed, &first);
+                second_size = encode_snapshot(cur, -1, opened, &second);
+                write_history_frame(fd, index_fd, HISTORY_DELTA, time_ms, first, first_size, second, second_size);
+                printf("%.3f\tdelta\t%zu rows\t%zu bytes\n", time_ms / 1000.0, changes,
+                       first_size + second_size);
+                free(first);
+                free(second);
+            }
         }
+        fflush(stdout);
+        nanosleep(&pause, NULL);
+    }
+}
 
-        closedir(dir);
+// Open a history log or its index for appending, writing the file header
+// to a new file and checking it on an existing one
+int open_history_file(const char *path, const char *magic) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Error opening history log");
+        exit(EXIT_FAILURE);
     }
 
-    else if(pid==-1){ // PID not given
-        ssize_t bufsize = 256;
-        char linkname[bufsize];
-        
-        // Open the /proc directory
-        dir = opendir("/proc");
-        if (dir == NULL) {
-            perror("Error opening /proc directory\n");
+    history_file_header header;
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    if (n == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic, sizeof(header.magic));
+        header.version = HISTORY_VERSION;
+        struct iovec iov = {&header, sizeof(header)};
+        if (write_all(fd, &iov, 1) == -1) {
+            perror("Error writing history log");
             exit(EXIT_FAILURE);
         }
+    }
+    else if (n != (ssize_t)sizeof(header) || memcmp(header.magic, magic, sizeof(header.magic)) != 0
+             || header.version != HISTORY_VERSION) {
+        fprintf(stderr, "Not a history log (or unsupported version): %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
 
-        // Traverse each process directory
-        while ((entry = readdir(dir)) != NULL) {
-            // Skip non-process directories
-            if (!isdigit(entry->d_name[0])) continue;
-
-            int check_pid = atoi(entry->d_name);
-            // check if we have permission to access this pid 
-            if (kill(check_pid, 0) == -1) {
-                continue; 
-            }
-
-            snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%s/fd/", entry->d_name);
-
-            DIR *fd_dir = opendir(proc_fd_path);
-            if (fd_dir != NULL) {
-                // Traverse each file descriptor entry
-                struct dirent *fd_entry;
-                while ((fd_entry = readdir(fd_dir)) != NULL) {
-                    // Skip "." and ".." entries
-                    if (strcmp(fd_entry->d_name, ".") == 0 || strcmp(fd_entry->d_name, "..") == 0)
-                        continue;
+// Flag the rows of before that are gone from after (closed) and the rows of
+// after that are new (opened). Both are sorted by (PID, fd); a descriptor
+// that now refers to another file counts as closed and opened, as in
+// --watch. Returns the number of flagged rows.
+size_t mark_deltas(const fd_snapshot *before, const fd_snapshot *after, char *closed, char *opened) {
+    size_t i = 0, j = 0, changes = 0;
+    memset(closed, 0, before->count);
+    memset(opened, 0, after->count);
 
-                    // Construct the file descriptor path
-                    char fd_path[MAX_PATH_LEN];
-                    snprintf(fd_path, MAX_PATH_LEN, "%s%s", proc_fd_path, fd_entry->d_name);
+    while (i < before->count || j < after->count) {
+        const fd_record *b = i < before->count ? &before->records[i] : NULL;
+        const fd_record *a = j < after->count ? &after->records[j] : NULL;
+        int order = a == NULL ? -1 : b == NULL ? 1 : compare_record_key(b, a);
 
-                    // Read the symbolic link to get the file name
-                    ssize_t len = readlink(fd_path, linkname, bufsize - 1);
-                    if (len != -1) {
-                        linkname[len] = '\0'; // Null-terminate the string
-                        printf("%s\t%s\n", entry->d_name, fd_entry->d_name);
-                    }
-                    else {
-                    perror("Error reading link\n");
-                    }
-                }
-                closedir(fd_dir);
+        if (order < 0) {
+            closed[i++] = 1;
+            changes++;
+        }
+        else if (order > 0) {
+            opened[j++] = 1;
+            changes++;
+        }
+        else {
+            if (a->has_inode != b->has_inode || a->inode != b->inode || a->dev != b->dev
+                || a->has_target != b->has_target || strcmp(a->target, b->target) != 0) {
+                closed[i] = 1;
+                opened[j] = 1;
+                changes += 2;
             }
+            i++;
+            j++;
         }
-        closedir(dir);
     }
-    printf("========================================\n");
+    return changes;
 }
 
-void display_systemwide_fd_table(pid_t pid) {
-    // Implement system-wide FD table display
-    char proc_fd_path[MAX_PATH_LEN];
-    DIR *dir;
-    struct dirent *entry;
+// Append one frame, then (for a keyframe) its index entry. The index is
+// written second so it never points past the data; a frame cut short by a
+// crash is ignored by the reader.
+void write_history_frame(int fd, int index_fd, uint32_t kind, int64_t time_ms, char *first, size_t first_size,
+                         char *second, size_t second_size) {
+    static char padding[8];
+    size_t first_pad = (8 - first_size % 8) % 8;
+    size_t second_pad = (8 - second_size % 8) % 8;
 
-    printf("PID\tFD\tFilename\n");
-    printf("========================================\n");
+    history_frame_header header;
+    memset(&header, 0, sizeof(header));
+    header.kind = kind;
+    header.time_ms = time_ms;
+    header.first_size = first_size + first_pad;
+    header.size = header.first_size + second_size + second_pad;
 
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error writing history log");
+        exit(EXIT_FAILURE);
+    }
+    struct iovec iov[5] = {
+        {&header, sizeof(header)},
+        {first, first_size},
+        {padding, first_pad},
+        {second, second_size},
+        {padding, second_pad},
+    };
+    if (write_all(fd, iov, 5) == -1) {
+        perror("Error writing history log");
+        exit(EXIT_FAILURE);
+    }
 
-    if (pid!=-1 && kill(pid, 0) != -1){
-        snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%d/fd", pid);
-        dir = opendir(proc_fd_path);
-        if (dir == NULL) {
-            perror("Error opening directory\n");
+    if (kind == HISTORY_KEYFRAME) {
+        history_index_entry entry;
+        entry.time_ms = time_ms;
+        entry.offset = (uint64_t)st.st_size;
+        struct iovec index_iov = {&entry, sizeof(entry)};
+        if (write_all(index_fd, &index_iov, 1) == -1) {
+            perror("Error writing history index");
             exit(EXIT_FAILURE);
         }
+    }
+}
 
-        while ((entry = readdir(dir)) != NULL) {
- 
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                char fd_path[MAX_PATH_LEN];
-                char filename[MAX_FILENAME_LEN];
-                ssize_t readlink_size;
+// Read a --record log. With changes, list the rows closed and opened in
+// the frames after from and up to to (the end when negative); otherwise
+// print the composite table as it was at time at (the latest when
+// negative). Either way the reader starts at the last keyframe at or
+// before the time of interest, found in the index, and replays from there.
+void replay_history(out_stream *out, const char *path, pid_t pid, double at, double from, double to, int changes) {
+    char index_path[strlen(path) + sizeof(".idx")];
+    size_t size, index_size = 0;
+    const char *base = map_history_file(path, HISTORY_MAGIC, &size);
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    const char *index_base = map_history_file(index_path, HISTORY_INDEX_MAGIC, &index_size);
 
-                snprintf(fd_path, MAX_PATH_LEN, "%s/%s", proc_fd_path, entry->d_name);
-                readlink_size = readlink(fd_path, filename, MAX_FILENAME_LEN - 1);
-                if (readlink_size != -1) {
-                    filename[readlink_size] = '\0';
-                    printf("%d\t%s\t%s\n", pid, entry->d_name, filename);
-                } 
-                else {
-                    perror("Error reading link\n");
-                }
-            }
+    double since = changes ? from : at;
+    int64_t since_ms = since < 0 ? INT64_MAX : (int64_t)(since * 1000);
+    int64_t until_ms = changes ? (to < 0 ? INT64_MAX : (int64_t)(to * 1000)) : since_ms;
+
+    // Binary search of the index for the last keyframe at or before since
+    uint64_t start = sizeof(history_file_header);
+    if (index_base != NULL) {
+        const history_index_entry *entries = (const history_index_entry *)(index_base + sizeof(history_file_header));
+        size_t lo = 0, hi = (index_size - sizeof(history_file_header)) / sizeof(history_index_entry);
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (entries[mid].time_ms <= since_ms) lo = mid + 1;
+            else hi = mid;
         }
+        if (lo > 0 && history_frame_valid(base, size, entries[lo - 1].offset)) {
+            start = entries[lo - 1].offset;
+        }
+    }
+    else {
+        // No index: walk the headers alone, skipping every payload
+        for (uint64_t off = start; history_frame_valid(base, size, off); ) {
+            const history_frame_header *frame = (const history_frame_header *)(base + off);
+            if (frame->time_ms > since_ms) break;
+            if (frame->kind == HISTORY_KEYFRAME) start = off;
+            off += sizeof(history_frame_header) + frame->size;
+        }
+    }
 
-        closedir(dir);
+    fd_snapshot state, scratch;
+    memset(&state, 0, sizeof(state));
+    memset(&scratch, 0, sizeof(scratch));
+    int have_state = 0;
+    if (!changes) {
+        composite_header(out, 0);
     }
 
-    else if(pid==-1){
-        ssize_t bufsize = 256;
-        char linkname[bufsize];
+    for (uint64_t off = start; history_frame_valid(base, size, off); ) {
+        const history_frame_header *frame = (const history_frame_header *)(base + off);
+        const char *payload = base + off + sizeof(history_frame_header);
+        off += sizeof(history_frame_header) + frame->size;
+        if (frame->time_ms > until_ms) break;
 
-        // Open the /proc directory
-        dir = opendir("/proc");
-        if (dir == NULL) {
-            perror("Error opening /proc directory\n");
-            exit(EXIT_FAILURE);
+        if (changes) {
+            // Only deltas carry changes; a keyframe just marks a restart
+            if (frame->kind != HISTORY_DELTA || frame->time_ms <= since_ms) continue;
+            print_blob_changes(out, frame->time_ms, '-', payload, pid);
+            print_blob_changes(out, frame->time_ms, '+', payload + frame->first_size, pid);
+        }
+        else if (frame->kind == HISTORY_KEYFRAME) {
+            state.count = 0;
+            load_blob_rows(&state, payload);
+            have_state = 1;
         }
+        else if (have_state) {
+            apply_history_delta(&state, &scratch, payload, payload + frame->first_size);
+        }
+    }
 
-        // Traverse each process directory
-        while ((entry = readdir(dir)) != NULL) {
-            // Skip non-process directories
-            if (!isdigit(entry->d_name[0])){
-                continue;
-            }
-            
-            int check_pid = atoi(entry->d_name);
-            // check if we have permission to access this pid 
-            if (kill(check_pid, 0) == -1) {
-                continue; 
-            }
+    if (!changes) {
+        composite_rows(out, &state, pid);
+        composite_footer(out);
+    }
+    free_snapshot(&state);
+    free_snapshot(&scratch);
+    munmap((void *)base, size);
+    if (index_base != NULL) {
+        munmap((void *)index_base, index_size);
+    }
+}
 
-            snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%s/fd/", entry->d_name);
+// Map a history log (required) or its index (optional: NULL when missing)
+// read-only after checking its header
+const char *map_history_file(const char *path, const char *magic, size_t *size) {
+    int is_index = strcmp(magic, HISTORY_INDEX_MAGIC) == 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (is_index && errno == ENOENT) return NULL;
+        perror("Error opening history log");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading history log");
+        exit(EXIT_FAILURE);
+    }
+    *size = (size_t)st.st_size;
+    const char *base = NULL;
+    if (*size >= sizeof(history_file_header)) {
+        base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            perror("Error mapping history log");
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
 
-            // Open the file descriptor directory of the process
-            DIR *fd_dir = opendir(proc_fd_path);
-            if (fd_dir != NULL) {
-                // Traverse each file descriptor entry
-                struct dirent *fd_entry;
-                while ((fd_entry = readdir(fd_dir)) != NULL) {
-                    // Skip "." and ".." entries
-                    if (strcmp(fd_entry->d_name, ".") == 0 || strcmp(fd_entry->d_name, "..") == 0)
-                        continue;
+    const history_file_header *header = (const history_file_header *)base;
+    if (base == NULL || memcmp(header->magic, magic, sizeof(header->magic)) != 0
+        || header->version != HISTORY_VERSION) {
+        if (is_index) {
+            if (base != NULL) munmap((void *)base, *size);
+            return NULL;
+        }
+        fprintf(stderr, "Not a history log (or unsupported version): %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return base;
+}
 
-                    // Construct the file descriptor path
-                    char fd_path[MAX_PATH_LEN];
-                    snprintf(fd_path, MAX_PATH_LEN, "%s%s", proc_fd_path, fd_entry->d_name);
+// A complete frame, with valid snapshot blobs, starts at offset
+int history_frame_valid(const char *base, size_t size, uint64_t offset) {
+    if (offset % 8 != 0 || offset + sizeof(history_frame_header) > size) return 0;
+    const history_frame_header *frame = (const history_frame_header *)(base + offset);
+    const char *payload = base + offset + sizeof(history_frame_header);
+    uint64_t room = size - offset - sizeof(history_frame_header);
+    if (frame->size > room || frame->first_size > frame->size) return 0;
+    if (frame->kind == HISTORY_KEYFRAME) {
+        return snapshot_valid(payload, frame->size);
+    }
+    return frame->kind == HISTORY_DELTA && snapshot_valid(payload, frame->first_size)
+        && snapshot_valid(payload + frame->first_size, frame->size - frame->first_size);
+}
 
-                    // Read the symbolic link to get the file name
-                    ssize_t len = readlink(fd_path, linkname, bufsize - 1);
-                    if (len != -1) {
-                        linkname[len] = '\0'; // Null-terminate the string
-                        printf("%s\t%s\t%s\n", entry->d_name, fd_entry->d_name, linkname);
-                    }
-                    else {
-                        perror("Error reading link\n");
-                    }
-                }
-                closedir(fd_dir);
-            }
-        }
-        closedir(dir);
+// Append a blob's rows to snap as records whose targets point into the blob
+void load_blob_rows(fd_snapshot *snap, const char *blob) {
+    const snapshot_file_header *header = (const snapshot_file_header *)blob;
+    const snapshot_file_record *records = (const snapshot_file_record *)(blob + header->records_offset);
+    const char *strings = blob + header->strings_offset;
+
+    for (uint64_t i = 0; i < header->record_count; i++) {
+        const snapshot_file_record *in = &records[i];
+        fd_record *rec = append_record_or_exit(snap);
+        rec->pid = in->pid;
+        rec->fd = in->fd;
+        rec->has_target = in->target != SNAPSHOT_NO_TARGET && in->target < header->strings_size;
+        rec->target = rec->has_target ? strings + in->target : "";
+        rec->has_inode = in->mode != 0;
+        rec->mode = in->mode;
+        rec->inode = in->inode;
+        rec->dev = in->dev;
     }
-    printf("========================================\n");
 }
 
-void display_vnodes_fd_table(pid_t pid) {
-    // Implement Vnodes FD table display
-        DIR *dir;
-    struct dirent *entry;
-    char proc_fd_path[MAX_PATH_LEN];
+// Replay one delta onto state (sorted by PID and fd): drop the closed rows,
+// merge in the opened ones. scratch receives the result and the two swap.
+void apply_history_delta(fd_snapshot *state, fd_snapshot *scratch, const char *closed, const char *opened) {
+    fd_snapshot gone, added;
+    memset(&gone, 0, sizeof(gone));
+    memset(&added, 0, sizeof(added));
+    load_blob_rows(&gone, closed);
+    load_blob_rows(&added, opened);
 
-    printf("FD\tInode\n");
-    printf("========================================\n");
-    
-    if(pid != -1 && kill(pid, 0) != -1){
-        snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%d/fd", pid);
-        dir = opendir(proc_fd_path);
-        if (dir == NULL) {
-            perror("Error opening directory\n");
-            exit(EXIT_FAILURE);
+    scratch->count = 0;
+    size_t g = 0, a = 0;
+    for (size_t i = 0; i <= state->count; i++) {
+        const fd_record *rec = i < state->count ? &state->records[i] : NULL;
+        // Opened rows that sort before this one go first
+        while (a < added.count && (rec == NULL || compare_record_key(&added.records[a], rec) < 0)) {
+            *append_record_or_exit(scratch) = added.records[a++];
         }
+        if (rec == NULL) break;
+        while (g < gone.count && compare_record_key(&gone.records[g], rec) < 0) {
+            g++;
+        }
+        if (g < gone.count && compare_record_key(&gone.records[g], rec) == 0) {
+            g++;
+            continue;
+        }
+        *append_record_or_exit(scratch) = *rec;
+    }
+
+    fd_snapshot swap = *state;
+    *state = *scratch;
+    *scratch = swap;
+    free_snapshot(&gone);
+    free_snapshot(&added);
+}
 
+// --changes lines: the frame time, then the row as --watch prints it
+void print_blob_changes(out_stream *out, int64_t time_ms, char op, const char *blob, pid_t pid) {
+    char stamp[32];
+    fd_snapshot rows;
+    memset(&rows, 0, sizeof(rows));
+    load_blob_rows(&rows, blob);
+    snprintf(stamp, sizeof(stamp), "%.3f\t", time_ms / 1000.0);
 
-        while ((entry = readdir(dir)) != NULL) {
+    for (size_t i = 0; i < rows.count; i++) {
+        if (pid != -1 && rows.records[i].pid != pid) continue;
+        out_str(out, stamp);
+        print_fd_delta(out, op, &rows.records[i]);
+    }
+    free_snapshot(&rows);
+}
 
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                char fd_path[MAX_PATH_LEN];
-                char filename[MAX_FILENAME_LEN];
-                ssize_t readlink_size;
+// Order records by PID, then fd
+int compare_record_key(const void *a, const void *b) {
+    const fd_record *ra = a;
+    const fd_record *rb = b;
+    if (ra->pid != rb->pid) return (ra->pid > rb->pid) - (ra->pid < rb->pid);
+    return (ra->fd > rb->fd) - (ra->fd < rb->fd);
+}
 
-                snprintf(fd_path, MAX_PATH_LEN, "%s/%s", proc_fd_path, entry->d_name);
-                readlink_size = readlink(fd_path, filename, MAX_FILENAME_LEN - 1);
-                if (readlink_size != -1) {
-                    // Get inode of the file
-                        struct stat statbuf;
-                        if (lstat(filename, &statbuf) != -1) {
-                            printf("%d\t%lu\n", pid, statbuf.st_ino);
-                        }
-                } 
-                else {
-                    perror("Error reading link\n");
-                }
-            }
-        }
+// Run as a resident server: rescan every interval seconds in a background
+// thread and answer queries on a Unix stream socket at path. A client sends
+// one request per line,
+//   composite | pid <PID> | threshold <N> | inode <DEV>:<INODE> | target <PATH>
+// and gets back, per line, the matching rows as one binary snapshot blob.
+// Queries only filter the in-memory snapshot, so they never touch /proc.
+void run_daemon(const char *path, const scan_options *opts, double interval) {
+    daemon_state state;
+    memset(&state, 0, sizeof(state));
+    state.opts = *opts;
+    state.interval = interval;
+    pthread_rwlock_init(&state.lock, NULL);
+    collect_or_exit(&state.snap, &state.opts);
+    build_fd_index(&state.idx, &state.snap);
+    state.composite = daemon_blob_encode(&state.snap, NULL);
 
-        closedir(dir);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("Error creating daemon socket");
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    // Replace a socket left behind by an earlier run, but nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    // The snapshot shows every process's files: owner-only access
+    mode_t old_mask = umask(0077);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 64) == -1) {
+        perror("Error binding daemon socket");
+        exit(EXIT_FAILURE);
     }
+    umask(old_mask);
 
-    else if(pid==-1){
-        // Implement composed table display
-        ssize_t bufsize = 256;
-        char linkname[bufsize];
+    pthread_t refresher;
+    if (pthread_create(&refresher, NULL, daemon_refresh_main, &state) != 0) {
+        perror("Error starting refresh thread");
+        exit(EXIT_FAILURE);
+    }
 
-        // Open the /proc directory
-        dir = opendir("/proc");
-        if (dir == NULL) {
-            perror("Error opening /proc directory\n");
+    // Each client gets a thread of its own, so a slow one only ever holds
+    // up itself
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Error accepting query");
+            exit(EXIT_FAILURE);
+        }
+        daemon_client *job = malloc(sizeof(daemon_client));
+        if (job == NULL) {
+            perror("Error allocating query");
             exit(EXIT_FAILURE);
         }
+        job->state = &state;
+        job->client = client;
+        pthread_t thread;
+        if (pthread_create(&thread, &detached, daemon_client_main, job) != 0) {
+            // Out of threads: turn this client away rather than stall
+            close(client);
+            free(job);
+        }
+    }
+}
 
-        // Traverse each process directory
-        while ((entry = readdir(dir)) != NULL) {
-            // Skip non-process directories
-            if (!isdigit(entry->d_name[0])) continue;
+void *daemon_client_main(void *arg) {
+    daemon_client *job = arg;
+    serve_client(job->state, job->client);
+    close(job->client);
+    free(job);
+    return NULL;
+}
 
-            int check_pid = atoi(entry->d_name);
-            // check if we have permission to access this pid 
-            if (kill(check_pid, 0) == -1) {
-                continue; 
-            }
+// Build the next snapshot off to the side, then swap it in under the write
+// lock so queries only ever wait for a pointer swap
+void *daemon_refresh_main(void *arg) {
+    daemon_state *state = arg;
+    struct timespec pause;
+    pause.tv_sec = (time_t)state->interval;
+    pause.tv_nsec = (long)((state->interval - (double)pause.tv_sec) * 1e9);
 
-            snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%s/fd/", entry->d_name);
+    // The snapshot swapped out is rescanned into next time round, so in
+    // steady state a refresh reuses its record arrays and arena
+    fd_snapshot spare;
+    memset(&spare, 0, sizeof(spare));
 
-            // Open the file descriptor directory of the process
-            DIR *fd_dir = opendir(proc_fd_path);
-            if (fd_dir != NULL) {
-                // Traverse each file descriptor entry
-                struct dirent *fd_entry;
-                while ((fd_entry = readdir(fd_dir)) != NULL) {
-                    // Skip "." and ".." entries
-                    if (strcmp(fd_entry->d_name, ".") == 0 || strcmp(fd_entry->d_name, "..") == 0)
-                        continue;
+    for (;;) {
+        nanosleep(&pause, NULL);
 
-                    // Construct the file descriptor path
-                    char fd_path[MAX_PATH_LEN];
-                    snprintf(fd_path, MAX_PATH_LEN, "%s%s", proc_fd_path, fd_entry->d_name);
+        fd_index idx;
+        collect_or_exit(&spare, &state->opts);
+        build_fd_index(&idx, &spare);
+        daemon_blob *composite = daemon_blob_encode(&spare, NULL);
 
-                    // Read the symbolic link to get the file name
-                    ssize_t len = readlink(fd_path, linkname, bufsize - 1);
-                    if (len != -1) {
-                        linkname[len] = '\0'; // Null-terminate the string
+        pthread_rwlock_wrlock(&state->lock);
+        fd_snapshot old_snap = state->snap;
+        fd_index old_idx = state->idx;
+        daemon_blob *old_composite = state->composite;
+        state->snap = spare;
+        state->idx = idx;
+        state->composite = composite;
+        pthread_rwlock_unlock(&state->lock);
 
-                        // Get inode of the file
-                        struct stat statbuf;
-                        if (lstat(linkname, &statbuf) != -1) {
-                            printf("%s\t%lu\n", fd_entry->d_name, statbuf.st_ino);
-                        }
-                    }
-                    else {
-                        perror("Error reading link\n");
-                    }
-                }
-                closedir(fd_dir);
-            }
-        }
-        closedir(dir);
+        free_fd_index(&old_idx);
+        daemon_blob_release(old_composite);
+        spare = old_snap;
     }
-
-    printf("========================================\n");
+    return NULL;
 }
 
-void display_composed_table(pid_t pid) {
-    DIR *dir;
-    struct dirent *entry;
-    char proc_fd_path[MAX_PATH_LEN];
+// Answer request lines until the client hangs up. Reading a request and
+// sending its reply must together finish within DAEMON_REQUEST_SECONDS,
+// however the client paces its bytes; an idle client is dropped as well.
+void serve_client(daemon_state *state, int client) {
+    char request[LINK_BUF_LEN + 64];
+    size_t len = 0;
+    double deadline = now_seconds() + DAEMON_REQUEST_SECONDS;
 
-    printf("PID\tFD\tFilename\tInode\n");
-    printf("========================================\n");
-    
-    if(pid != -1 && kill(pid, 0) != -1){
-        snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%d/fd", pid);
-        dir = opendir(proc_fd_path);
-        if (dir == NULL) {
-            perror("Error opening directory\n");
-            exit(EXIT_FAILURE);
+    for (;;) {
+        char *newline = memchr(request, '\n', len);
+        if (newline == NULL) {
+            if (len == sizeof(request)) return; // overlong request: drop the client
+            if (!client_time_left(client, SO_RCVTIMEO, deadline)) return;
+            ssize_t n = read(client, request + len, sizeof(request) - len);
+            if (n <= 0) return;
+            len += (size_t)n;
+            continue;
         }
+        *newline = '\0';
 
-        while ((entry = readdir(dir)) != NULL) {
-
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                char fd_path[MAX_PATH_LEN];
-                char filename[MAX_FILENAME_LEN];
-                ssize_t readlink_size;
+        pthread_rwlock_rdlock(&state->lock);
+        daemon_blob *reply = answer_query(state, request);
+        pthread_rwlock_unlock(&state->lock);
 
-                snprintf(fd_path, MAX_PATH_LEN, "%s/%s", proc_fd_path, entry->d_name);
-                readlink_size = readlink(fd_path, filename, MAX_FILENAME_LEN - 1);
-                if (readlink_size != -1) {
-                    // Get inode of the file
-                        struct stat statbuf;
-                        if (lstat(filename, &statbuf) != -1) {
-                            printf("%d\t%s\t%s\t%lu\n", pid, entry->d_name, filename, statbuf.st_ino);
-                        }
-                } 
-                else {
-                    perror("Error reading link\n");
-                }
-            }
+        ssize_t sent = 0;
+        for (size_t off = 0; off < reply->size; off += (size_t)sent) {
+            sent = -1;
+            if (!client_time_left(client, SO_SNDTIMEO, deadline)) break;
+            sent = send(client, reply->data + off, reply->size - off, MSG_NOSIGNAL);
+            if (sent <= 0) break;
         }
+        daemon_blob_release(reply);
+        if (sent <= 0) return;
 
-        closedir(dir);
+        size_t used = (size_t)(newline - request) + 1;
+        memmove(request, request + used, len - used);
+        len -= used;
+        deadline = now_seconds() + DAEMON_REQUEST_SECONDS;
     }
+}
 
-    
-    
-    if (pid == -1){
-        // Implement composed table display
-        ssize_t bufsize = 256;
-        char linkname[bufsize];
-
-        // Open the /proc directory
-        dir = opendir("/proc");
-        if (dir == NULL) {
-            perror("Error opening /proc directory\n");
-            exit(EXIT_FAILURE);
-        }
-
-        // Traverse each process directory
-        while ((entry = readdir(dir)) != NULL) {
-            // Skip non-process directories
-            if (!isdigit(entry->d_name[0])) continue;
-            
-            int check_pid = atoi(entry->d_name);
-            // check if we have permission to access this pid 
-            if (kill(check_pid, 0) == -1) {
-                continue; 
-            }
-
-            snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%s/fd/", entry->d_name);
-
-            // Open the file descriptor directory of the process
-            DIR *fd_dir = opendir(proc_fd_path);
-            if (fd_dir != NULL) {
-                // Traverse each file descriptor entry
-                struct dirent *fd_entry;
-                while ((fd_entry = readdir(fd_dir)) != NULL) {
-                    // Skip "." and ".." entries
-                    if (strcmp(fd_entry->d_name, ".") == 0 || strcmp(fd_entry->d_name, "..") == 0)
-                        continue;
+// Set the socket's receive or send timeout to what remains until deadline;
+// 0 once it has passed
+int client_time_left(int client, int option, double deadline) {
+    double left = deadline - now_seconds();
+    if (left <= 0) return 0;
+    struct timeval timeout;
+    timeout.tv_sec = (time_t)left;
+    timeout.tv_usec = (suseconds_t)((left - (double)timeout.tv_sec) * 1e6);
+    if (timeout.tv_sec == 0 && timeout.tv_usec == 0) timeout.tv_usec = 1; // 0 would mean no timeout
+    setsockopt(client, SOL_SOCKET, option, &timeout, sizeof(timeout));
+    return 1;
+}
 
-                    // Construct the file descriptor path
-                    char fd_path[MAX_PATH_LEN];
-                    snprintf(fd_path, MAX_PATH_LEN, "%s%s", proc_fd_path, fd_entry->d_name);
+// The reply to one request; an unknown request gets an empty snapshot.
+// Runs with the state's read lock held. A composite query shares the blob
+// encoded at refresh time; the others encode only the rows they keep.
+daemon_blob *answer_query(daemon_state *state, const char *request) {
+    const fd_snapshot *snap = &state->snap;
 
-                    // Read the symbolic link to get the file name
-                    ssize_t len = readlink(fd_path, linkname, bufsize - 1);
-                    if (len != -1) {
-                        linkname[len] = '\0'; // Null-terminate the string
+    if (strcmp(request, "composite") == 0) {
+        __atomic_add_fetch(&state->composite->refs, 1, __ATOMIC_RELAXED);
+        return state->composite;
+    }
+    if (strncmp(request, "pid ", 4) == 0 && isPid((char *)request + 4) && request[4] != '\0') {
+        // The composite blob holds every record in snapshot order, so its
+        // PID index gives the process's rows without a pass over the rest
+        const char *base = state->composite->data;
+        const snapshot_file_header *header = (const snapshot_file_header *)base;
+        snapshot_file_index key;
+        key.pid = atoi(request + 4);
+        const snapshot_file_index *found = bsearch(&key, base + header->index_offset, header->index_count,
+                                                   sizeof(snapshot_file_index), compare_file_index);
+        fd_snapshot rows = *snap;
+        rows.records = found != NULL ? &snap->records[found->first] : NULL;
+        rows.count = found != NULL ? found->count : 0;
+        return daemon_blob_encode(&rows, NULL);
+    }
 
-                        // Get inode of the file
-                        struct stat statbuf;
-                        if (lstat(linkname, &statbuf) != -1) {
-                            printf("%s\t%s\t%s\t%lu\n", entry->d_name, fd_entry->d_name, linkname, statbuf.st_ino);
-                        }
-                    }
-                    else {
-                        perror("Error reading link\n");
-                    }
+    char *keep = calloc(snap->count + 1, 1);
+    if (keep == NULL) {
+        perror("Error allocating query");
+        exit(EXIT_FAILURE);
+    }
+    if (strncmp(request, "threshold ", 10) == 0) {
+        // Every row of the offending processes; the reply's index holds
+        // their counts. Records of one PID are contiguous, procs in order.
+        unsigned long threshold = strtoul(request + 10, NULL, 10);
+        size_t r = 0;
+        for (size_t p = 0; p < snap->nprocs; p++) {
+            int offending = snap->procs[p].fds > threshold;
+            for (; r < snap->count && snap->records[r].pid == snap->procs[p].pid; r++) {
+                keep[r] = (char)offending;
+            }
+        }
+    }
+    else if (strncmp(request, "inode ", 6) == 0 || strncmp(request, "target ", 7) == 0) {
+        open_by_query q;
+        memset(&q, 0, sizeof(q));
+        if (request[0] == 'i') {
+            // "inode DEV:INO [PATH]": a path query resolved by the client
+            unsigned long long dev, ino;
+            int len = 0;
+            if (sscanf(request + 6, "%llu:%llu%n", &dev, &ino, &len) == 2) {
+                q.by_inode = 1;
+                q.dev = (dev_t)dev;
+                q.ino = (ino_t)ino;
+                if (request[6 + len] == ' ' && request[7 + len] != '\0') {
+                    q.by_path = 1;
+                    q.text = request + 7 + len;
                 }
-                closedir(fd_dir);
+                mark_open_by(&state->idx, snap, &q, keep);
             }
         }
-        closedir(dir);
+        else {
+            q.text = request + 7;
+            mark_open_by(&state->idx, snap, &q, keep);
+        }
     }
-    printf("========================================\n");
-}
 
-void flag_offending_processes(int threshold) {
-    DIR *proc_dir;
-    struct dirent *entry;
+    daemon_blob *reply = daemon_blob_encode(snap, keep);
+    free(keep);
+    return reply;
+}
 
-    // Open the /proc directory
-    proc_dir = opendir("/proc");
-    if (proc_dir == NULL) {
-        perror("Error opening /proc directory");
+daemon_blob *daemon_blob_encode(const fd_snapshot *snap, const char *keep) {
+    daemon_blob *blob = malloc(sizeof(daemon_blob));
+    if (blob == NULL) {
+        perror("Error allocating query");
         exit(EXIT_FAILURE);
     }
+    blob->refs = 1;
+    blob->size = encode_snapshot(snap, -1, keep, &blob->data);
+    return blob;
+}
 
-    printf("\nOffending processes (PID, FD):\n");
-
-    // Iterate through each entry in the /proc directory
-    while ((entry = readdir(proc_dir)) != NULL) {
-        // Convert the entry name to a process ID
-        pid_t pid = atoi(entry->d_name);
+void daemon_blob_release(daemon_blob *blob) {
+    if (__atomic_sub_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(blob->data);
+        free(blob);
+    }
+}
 
-        // check if we have permission to access this pid 
-        if (kill(pid, 0) == -1) {
-            continue; 
+// Set keep[i] for every record the --open-by query matches (see
+// parse_open_by)
+void mark_open_by(const fd_index *idx, const fd_snapshot *snap, const open_by_query *q, char *keep) {
+    if (q->by_inode) {
+        for (size_t i = fd_index_next_inode(idx, snap, q->dev, q->ino, FD_INDEX_START); i != FD_INDEX_END;
+             i = fd_index_next_inode(idx, snap, q->dev, q->ino, i)) {
+            keep[i] = 1;
         }
+        if (!q->by_path) return;
+    }
+    // The path's unlinked copies, and the path itself when it is gone
+    char deleted[strlen(q->text) + sizeof(" (deleted)")];
+    snprintf(deleted, sizeof(deleted), "%s (deleted)", q->text);
+    const char *names[2] = {deleted, q->text};
+    for (int n = 0; n < (q->by_inode ? 1 : 2); n++) {
+        for (size_t i = fd_index_next_target(idx, snap, names[n], FD_INDEX_START); i != FD_INDEX_END;
+             i = fd_index_next_target(idx, snap, names[n], i)) {
+            keep[i] = 1;
+        }
+    }
+}
 
-        if (pid > 0) {
-            char proc_fd_path[MAX_PATH_LEN];
-            DIR *proc_fd_dir;
-            struct dirent *fd_entry;
-
-            // Construct the path to the /proc/<pid>/fd directory
-            snprintf(proc_fd_path, MAX_PATH_LEN, "/proc/%s/fd", entry->d_name);
-            proc_fd_dir = opendir(proc_fd_path);
-
-            if (proc_fd_dir != NULL) {
-                // Check each file descriptor for the process
-                while ((fd_entry = readdir(proc_fd_dir)) != NULL) {
-                    if (strcmp(fd_entry->d_name, ".") != 0 && strcmp(fd_entry->d_name, "..") != 0) {
-                        int fd = atoi(fd_entry->d_name);
-                        if (fd > threshold) {
-                            printf("%s (%d), ", entry->d_name, fd);
-                        }
-                    }
-                }
+// Client side: send one request line on sock and read back the reply blob,
+// validated. Returns the blob size.
+size_t query_daemon(int sock, const char *request, char **blob) {
+    size_t len = strlen(request);
+    if (write(sock, request, len) != (ssize_t)len || write(sock, "\n", 1) != 1) {
+        perror("Error sending query");
+        exit(EXIT_FAILURE);
+    }
 
-                closedir(proc_fd_dir);
-            } 
-            //else {
-            //    perror("Error opening process FD directory\n");
-            //}
-        }
+    snapshot_file_header header;
+    if (read_full(sock, (char *)&header, sizeof(header)) != 0) {
+        fprintf(stderr, "Daemon closed the connection\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = header.strings_offset + header.strings_size;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+        || size < sizeof(header) || header.strings_offset < sizeof(header)) {
+        fprintf(stderr, "Malformed reply from daemon\n");
+        exit(EXIT_FAILURE);
+    }
+    *blob = malloc(size);
+    if (*blob == NULL) {
+        perror("Error allocating query reply");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(*blob, &header, sizeof(header));
+    if (read_full(sock, *blob + sizeof(header), size - sizeof(header)) != 0 || !snapshot_valid(*blob, size)) {
+        fprintf(stderr, "Malformed reply from daemon\n");
+        exit(EXIT_FAILURE);
     }
-    closedir(proc_dir);
+    return size;
 }
 
-int isPid(char *string){
-    int res = 1;
-    for (int i=0; string[i]!='\0';i++){
-        if (!isdigit(string[i])){
-            res = 0;
-        }
+int read_full(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
     }
-    return res;
+    return 0;
 }
 
-void save_composite_table_text(const char *filename, pid_t pid) {
-    FILE *file = fopen(filename, "w");
-    if (file == NULL) {
-        perror("Error opening file for writing");
+// Print the composite, threshold and open-by views from a running daemon
+// instead of scanning /proc
+void display_from_daemon(out_stream *out, const char *path, pid_t pid, int composite, int threshold,
+                         const char *open_by) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Error connecting to daemon");
         exit(EXIT_FAILURE);
     }
 
-    // Redirect stdout to the file
-    dup2(fileno(file), STDOUT_FILENO);
+    char request[LINK_BUF_LEN + 64];
+    char *blob;
 
-    // Display the composite table
-    display_composed_table(pid);
+    if (composite) {
+        if (pid != -1) {
+            snprintf(request, sizeof(request), "pid %d", pid);
+        }
+        else {
+            strcpy(request, "composite");
+        }
+        query_daemon(sock, request, &blob);
+        composite_header(out, 0);
+        write_binary_rows(out, blob, -1);
+        composite_footer(out);
+        free(blob);
+    }
 
-    // Close the file
-    fclose(file);
-}
+    if (threshold != -1) {
+        snprintf(request, sizeof(request), "threshold %d", threshold);
+        query_daemon(sock, request, &blob);
+        const snapshot_file_header *header = (const snapshot_file_header *)blob;
+        const snapshot_file_index *index = (const snapshot_file_index *)(blob + header->index_offset);
+        out_str(out, "\nOffending processes (PID, FD count):\n");
+        out_str(out, TABLE_RULE);
+        for (uint64_t i = 0; i < header->index_count; i++) {
+            out_int(out, index[i].pid);
+            out_char(out, '\t');
+            out_uint(out, index[i].count);
+            out_char(out, '\n');
+        }
+        out_str(out, TABLE_RULE);
+        free(blob);
+    }
 
-void save_composite_table_binary(const char *filename, pid_t pid) {
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        perror("Error opening file for writing");
-        exit(EXIT_FAILURE);
+    if (open_by != NULL) {
+        // Paths are resolved here, with the caller's view of the filesystem
+        open_by_query q;
+        parse_open_by(open_by, &q);
+        if (q.by_inode && q.by_path) {
+            snprintf(request, sizeof(request), "inode %llu:%llu %s", (unsigned long long)q.dev,
+                     (unsigned long long)q.ino, open_by);
+        }
+        else if (q.by_inode) {
+            snprintf(request, sizeof(request), "inode %llu:%llu", (unsigned long long)q.dev, (unsigned long long)q.ino);
+        }
+        else {
+            snprintf(request, sizeof(request), "target %s", open_by);
+        }
+        query_daemon(sock, request, &blob);
+        if (out->format == OUT_TEXT) {
+            out_str(out, "\nProcesses with ");
+            out_str(out, open_by);
+            out_str(out, " open:\n");
+        }
+        composite_header(out, 0);
+        write_binary_rows(out, blob, -1);
+        composite_footer(out);
+        free(blob);
     }
 
-    char command[MAX_LINE_LEN];
+    close(sock);
+}
 
-    snprintf(command, sizeof(command), "./showFDtables %d --composite", pid);
+// Return the offset of str in the table, appending it on first sight
+uint32_t intern_string(string_table *table, const char *str) {
+    size_t mask = table->slot_count - 1;
+    size_t slot = hash_string(str) & mask;
 
-    // Use pipe to capture stdout
-    FILE *pipe = popen(command, "r");
-    if (pipe == NULL){
-        perror("Error opening pipe");
-        exit(EXIT_FAILURE);
+    while (table->slots[slot] != UINT32_MAX) {
+        if (strcmp(table->data + table->slots[slot], str) == 0) {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & mask;
     }
 
+    size_t len = strlen(str) + 1;
+    while (table->size + len > table->capacity) {
+        table->capacity *= 2;
+        table->data = realloc(table->data, table->capacity);
+        if (table->data == NULL) {
+            perror("Error allocating string table");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint32_t offset = (uint32_t)table->size;
+    memcpy(table->data + table->size, str, len);
+    table->size += len;
+    table->slots[slot] = offset;
+    table->used++;
 
-    char buffer[MAX_LINE_LEN];
-    size_t byte_read;
+    // Keep the load factor under 1/2 by rehashing into twice the slots
+    if (table->used * 2 > table->slot_count) {
+        size_t old_count = table->slot_count;
+        uint32_t *old_slots = table->slots;
+        table->slot_count *= 2;
+        table->slots = malloc(table->slot_count * sizeof(uint32_t));
+        if (table->slots == NULL) {
+            perror("Error allocating string table");
+            exit(EXIT_FAILURE);
+        }
+        memset(table->slots, 0xff, table->slot_count * sizeof(uint32_t));
+        mask = table->slot_count - 1;
+        for (size_t i = 0; i < old_count; i++) {
+            if (old_slots[i] == UINT32_MAX) continue;
+            size_t s = hash_string(table->data + old_slots[i]) & mask;
+            while (table->slots[s] != UINT32_MAX) {
+                s = (s + 1) & mask;
+            }
+            table->slots[s] = old_slots[i];
+        }
+        free(old_slots);
+    }
+    return offset;
+}
 
-    while ((byte_read = fread(buffer, sizeof(char),sizeof(buffer),pipe)) != 0){
-        fwrite(buffer, sizeof(char), strlen(buffer), file);
+// FNV-1a
+uint64_t hash_string(const char *str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
 
-    pclose(pipe);
-    fclose(file);
+int compare_file_index(const void *a, const void *b) {
+    int32_t pa = ((const snapshot_file_index *)a)->pid;
+    int32_t pb = ((const snapshot_file_index *)b)->pid;
+    return (pa > pb) - (pa < pb);
 }
 
 
 void display_usage(){
-    printf("Usage: ./program_name [PID] [--per-process] [--systemWide] [--Vnodes] [--composite] [--threshold=X]\n");
+    printf("Usage: ./program_name [PID] [--per-process] [--systemWide] [--Vnodes] [--composite] [--threshold=X] [--top=K] [--open-by=PATH|DEV:INODE] [--jobs=N] [--proc-root=DIR] [--stats[=text|json]] [--sockets] [--uring] [--uid=UID] [--comm=GLOB] [--pid-list=PID,...] [--fd-type=file|socket|pipe|anon] [--path-prefix=DIR] [--format=text|ndjson|csv|tsv] [--columns=pid,fd,filename,inode,pos,flags,mnt_id,extra] [--summary=pid|uid|mount|type|target,...] [--budget=MS] [--output_TXT] [--output_binary] [--output=text|ndjson|csv|tsv|binary:FILE] [--read_binary=FILE] [--watch=SECONDS] [--leaks=SECONDS [--samples=N]] [--daemon=SOCKET [--refresh=SECONDS]] [--query=SOCKET] [--record=FILE [--refresh=SECONDS] [--keyframe=N]] [--replay=FILE [--at=TIME | --changes=FROM[,TO]]]\n");
+    printf("--leaks samples only each process's fd count. The file/socket/pipe/anon split on a LEAK line is a single snapshot, taken when the process is flagged, not a trend per class.\n");
 }
\ No newline at end of file
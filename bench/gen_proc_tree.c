@@ -0,0 +1,219 @@
+/**
+ * Program: Fake /proc Tree Generator
+ * Description: Builds a directory that looks like /proc to showFDtables
+ * (<root>/<pid>/fd/<n> symlinks, <root>/<pid>/fdinfo/<n> and <root>/<pid>/comm) so scan
+ * performance can be measured reproducibly with --proc-root=<root>.
+ *
+ * Usage: gen_proc_tree <root> [--procs=N] [--fds=N] [--dist=uniform|zipf]
+ *                      [--files=N] [--mix=file:70,socket:10,pipe:10,anon:10]
+ *                      [--seed=N]
+ *
+ *   --fds    descriptors per process (uniform), or for the heaviest
+ *            process (zipf: the process of rank r gets fds/r, at least 3)
+ *   --files  number of distinct regular files the "file" targets share
+ *   --mix    percentage of each target type
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_PATH_LEN 4096
+
+enum { TARGET_FILE, TARGET_SOCKET, TARGET_PIPE, TARGET_ANON, TARGET_KINDS };
+
+// Function prototypes
+void make_dir(const char *path);
+void parse_mix(const char *spec, int *mix);
+int pick_target(const int *mix);
+unsigned long next_random(void);
+void display_usage();
+
+static unsigned long random_state = 88172645463325252UL;
+
+int main(int argc, char *argv[]) {
+    const char *root = NULL;
+    int procs = 1000, fds = 20, files = 500, zipf = 0;
+    int mix[TARGET_KINDS] = {70, 10, 10, 10};
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--procs=", 8) == 0){
+            procs = atoi(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "--fds=", 6) == 0){
+            fds = atoi(argv[i] + 6);
+        }
+        else if (strncmp(argv[i], "--files=", 8) == 0){
+            files = atoi(argv[i] + 8);
+        }
+        else if (strcmp(argv[i], "--dist=zipf") == 0){
+            zipf = 1;
+        }
+        else if (strcmp(argv[i], "--dist=uniform") == 0){
+            zipf = 0;
+        }
+        else if (strncmp(argv[i], "--mix=", 6) == 0){
+            parse_mix(argv[i] + 6, mix);
+        }
+        else if (strncmp(argv[i], "--seed=", 7) == 0){
+            random_state = strtoul(argv[i] + 7, NULL, 10) | 1;
+        }
+        else if (argv[i][0] != '-' && root == NULL){
+            root = argv[i];
+        }
+        else{
+            printf("Unknown argument: %s\n", argv[i]);
+            display_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (root == NULL || procs < 1 || fds < 1 || files < 1) {
+        display_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    char path[MAX_PATH_LEN];
+    char target[MAX_PATH_LEN];
+
+    // Shared regular files, spread over a few directories like real trees
+    make_dir(root);
+    snprintf(path, sizeof(path), "%s/files", root);
+    make_dir(path);
+    for (int f = 0; f < files; f++) {
+        snprintf(path, sizeof(path), "%s/files/d%02d", root, f % 16);
+        make_dir(path);
+        snprintf(path, sizeof(path), "%s/files/d%02d/file%06d.log", root, f % 16, f);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("Error creating target file");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+
+    unsigned long inode = 100000, total = 0;
+    for (int p = 0; p < procs; p++) {
+        int pid = 1000 + p;
+        int count = zipf ? fds / (p + 1) : fds;
+        if (count < 3) count = 3;
+
+        snprintf(path, sizeof(path), "%s/%d", root, pid);
+        make_dir(path);
+        snprintf(path, sizeof(path), "%s/%d/fd", root, pid);
+        make_dir(path);
+        snprintf(path, sizeof(path), "%s/%d/fdinfo", root, pid);
+        make_dir(path);
+
+        // A handful of command names, for --comm filters
+        snprintf(path, sizeof(path), "%s/%d/comm", root, pid);
+        FILE *comm = fopen(path, "w");
+        if (comm == NULL) {
+            perror("Error creating comm file");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(comm, "worker%d\n", pid % 8);
+        fclose(comm);
+
+        for (int n = 0; n < count; n++) {
+            switch (pick_target(mix)) {
+            case TARGET_SOCKET:
+                snprintf(target, sizeof(target), "socket:[%lu]", inode++);
+                break;
+            case TARGET_PIPE:
+                snprintf(target, sizeof(target), "pipe:[%lu]", inode++);
+                break;
+            case TARGET_ANON:
+                snprintf(target, sizeof(target), "anon_inode:[eventpoll]");
+                break;
+            default: {
+                int f = (int)(next_random() % (unsigned long)files);
+                snprintf(target, sizeof(target), "%s/files/d%02d/file%06d.log", root, f % 16, f);
+                break;
+            }
+            }
+            snprintf(path, sizeof(path), "%s/%d/fd/%d", root, pid, n);
+            if (symlink(target, path) == -1 && errno != EEXIST) {
+                perror("Error creating fd link");
+                exit(EXIT_FAILURE);
+            }
+
+            // Enough fdinfo for --columns=pos,flags,mnt_id
+            snprintf(path, sizeof(path), "%s/%d/fdinfo/%d", root, pid, n);
+            FILE *info = fopen(path, "w");
+            if (info == NULL) {
+                perror("Error creating fdinfo file");
+                exit(EXIT_FAILURE);
+            }
+            fprintf(info, "pos:\t%d\nflags:\t02\nmnt_id:\t%d\n", n * 512, 20 + n % 4);
+            fclose(info);
+        }
+        total += count;
+    }
+
+    printf("%s: %d processes, %lu descriptors\n", root, procs, total);
+    return 0;
+}
+
+void make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating directory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// "file:70,socket:10,pipe:10,anon:10"; types left out get 0
+void parse_mix(const char *spec, int *mix) {
+    static const char *names[TARGET_KINDS] = {"file", "socket", "pipe", "anon"};
+    for (int t = 0; t < TARGET_KINDS; t++) {
+        mix[t] = 0;
+    }
+    while (*spec != '\0') {
+        int matched = 0;
+        for (int t = 0; t < TARGET_KINDS; t++) {
+            size_t len = strlen(names[t]);
+            if (strncmp(spec, names[t], len) == 0 && spec[len] == ':') {
+                mix[t] = atoi(spec + len + 1);
+                matched = 1;
+                break;
+            }
+        }
+        if (!matched) {
+            printf("Bad --mix entry: %s\n", spec);
+            exit(EXIT_FAILURE);
+        }
+        const char *comma = strchr(spec, ',');
+        if (comma == NULL) break;
+        spec = comma + 1;
+    }
+}
+
+int pick_target(const int *mix) {
+    int sum = 0;
+    for (int t = 0; t < TARGET_KINDS; t++) {
+        sum += mix[t];
+    }
+    if (sum <= 0) return TARGET_FILE;
+    int r = (int)(next_random() % (unsigned long)sum);
+    for (int t = 0; t < TARGET_KINDS; t++) {
+        if (r < mix[t]) return t;
+        r -= mix[t];
+    }
+    return TARGET_FILE;
+}
+
+// xorshift64: fast and, with a fixed seed, the same tree on every run
+unsigned long next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+void display_usage(){
+    printf("Usage: gen_proc_tree <root> [--procs=N] [--fds=N] [--dist=uniform|zipf] [--files=N] [--mix=file:P,socket:P,pipe:P,anon:P] [--seed=N]\n");
+}
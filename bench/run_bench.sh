@@ -0,0 +1,36 @@
+#!/bin/sh
+# Scan benchmark over a synthetic /proc tree.
+#
+# Usage: bench/run_bench.sh [procs] [fds] [dist]
+#
+# Builds a fake tree with bench/gen_proc_tree, then runs showFDtables once
+# per display mode with --proc-root and --stats, and prints descriptors per
+# second, syscalls per descriptor and peak RSS for each mode.
+
+set -e
+
+PROCS=${1:-2000}
+FDS=${2:-200}
+DIST=${3:-zipf}
+BIN=./showFDtables
+GEN=./bench/gen_proc_tree
+
+TREE=$(mktemp -d "${TMPDIR:-/tmp}/fakeproc.XXXXXX")
+STATS="$TREE.stats"
+trap 'rm -rf "$TREE" "$STATS"' EXIT INT TERM
+
+"$GEN" "$TREE" --procs="$PROCS" --fds="$FDS" --dist="$DIST" --seed=1
+
+printf '%-28s %12s %12s %12s %12s\n' "mode" "fds" "fds/sec" "syscalls/fd" "peakRSS(KiB)"
+for MODE in "--per-process" "--systemWide" "--Vnodes" "--composite" \
+            "--composite --jobs=4" "--top=10" "--threshold=100"; do
+    # shellcheck disable=SC2086
+    "$BIN" --proc-root="$TREE" $MODE --stats > /dev/null 2> "$STATS"
+    awk -v mode="$MODE" -F'\t+' '
+        /descriptors:/       { fds = $2 }
+        /descriptors\/sec:/  { rate = $2 }
+        /syscalls per fd:/   { per = $2 }
+        /peak RSS/           { rss = $2 }
+        END { printf "%-28s %12s %12s %12s %12s\n", mode, fds, rate, per, rss }
+    ' "$STATS"
+done
@@ -0,0 +1,66 @@
+/**
+ * Embedding interface to the scanner in a2.c, built by `make lib` as
+ * libfdtables.a and libfdtables.so. A program links it instead of running
+ * showFDtables and parsing its text.
+ *
+ * A scanner owns every buffer a scan needs and keeps them from one scan to
+ * the next, so a monitor that rescans on a timer stops allocating once the
+ * buffers have grown to fit. Records are handed to a callback one process
+ * at a time; nothing is allocated or copied per record.
+ *
+ * The library never exits. fdt_scan reports failures (ENOMEM,
+ * say) by returning -1 with errno set, after releasing every descriptor
+ * and temporary buffer the scan opened; the scanner stays usable.
+ */
+
+#ifndef FDTABLES_H
+#define FDTABLES_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FDT_API __attribute__((visibility("default")))
+
+// Flags for fdt_scan
+#define FDT_STAT 1                  // stat() each descriptor: fills inode, dev and mode
+
+// One open file descriptor. The record and its target are only valid
+// during the callback; copy whatever has to outlive it.
+typedef struct {
+    pid_t pid;
+    int fd;
+    const char *target;             // link target, NUL-terminated; "" if unread
+    size_t target_len;
+    int has_target;                 // readlink() on the fd succeeded
+    int has_stat;                   // FDT_STAT was given and stat() succeeded
+    ino_t inode;
+    dev_t dev;
+    mode_t mode;                    // file type bits, sockets and pipes included
+} fdt_record;
+
+typedef struct fdt_scanner fdt_scanner;
+
+typedef void (*fdt_callback)(const fdt_record *rec, void *arg);
+
+// Open a scanner on proc_root ("/proc" when NULL). Returns NULL with errno
+// set when proc_root cannot be opened.
+FDT_API fdt_scanner *fdt_open(const char *proc_root);
+
+// Scan pid (-1 for every process) and pass each descriptor to callback, in
+// the order the scan reaches them. Returns the number of records passed,
+// or -1 with errno set: EACCES or ENOENT for a single pid that may not be
+// read or does not exist, ENOMEM when memory runs out, or the error
+// opening the proc root. A full scan skips the processes it cannot read.
+FDT_API ssize_t fdt_scan(fdt_scanner *scanner, pid_t pid, int flags, fdt_callback callback, void *arg);
+
+FDT_API void fdt_close(fdt_scanner *scanner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif